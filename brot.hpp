@@ -0,0 +1,1701 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <complex>
+
+#include <immintrin.h>
+
+#include "Tracy.hpp"
+
+#include "colour.hpp"
+#include "brotraw.hpp"
+
+
+// The CPU escape-time engine: frame storage and the kernels that fill it.
+// Shared by ParallelBrot and the tiled viewer in GLBrot.
+
+// Palette index (count % 255) of n counts, a vector at a time
+inline void palette_indices(const double* counts, int n, int32_t* out)
+    {
+    int x = 0;
+#ifdef __AVX512F__
+    const __m512d period = _mm512_set1_pd(255);
+    for (; x + 8 <= n; x += 8)
+        {
+        __m512d c = _mm512_loadu_pd(counts + x);
+        __m512d q = _mm512_roundscale_pd(_mm512_div_pd(c, period), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256((__m256i*)(out + x), _mm512_cvttpd_epi32(_mm512_fnmadd_pd(q, period, c)));
+        }
+#else
+    const __m256d period = _mm256_set1_pd(255);
+    for (; x + 4 <= n; x += 4)
+        {
+        __m256d c = _mm256_loadu_pd(counts + x);
+        __m256d q = _mm256_floor_pd(_mm256_div_pd(c, period));
+        _mm_storeu_si128((__m128i*)(out + x), _mm256_cvttpd_epi32(_mm256_sub_pd(c, _mm256_mul_pd(q, period))));
+        }
+#endif
+    for (; x < n; x++)
+        out[x] = (int)counts[x] % 255;
+    }
+
+class Image {
+private:
+    Colour colours;
+    unsigned char palette[3 * 255];   // PPM bytes of each palette index
+    double** rows;
+    bool owns_pixels;
+
+    // Colours set directly by set_colour (3 per pixel), used instead of the
+    // palette where smoothed is 1. Empty until the first set_colour.
+    std::vector<double> smoothed_rgb;
+    std::vector<unsigned char> smoothed;
+
+    // Distance to the set in pixels, written by populate_img_distance_*, and
+    // the distance at which the shading turns white. Empty unless enabled.
+    std::vector<float> distances;
+    double fade = 0;
+
+public:
+    int height;
+    int width;
+    double aspect_ratio;
+
+    // An Image can hold just rows [row_origin, row_origin + height) of a frame
+    // frame_height rows tall; the kernels then give exactly the pixels the
+    // whole frame would have there. See place_in_frame.
+    int row_origin;
+    int frame_height;
+
+    Image(int w, int h):
+        owns_pixels(true), height(h), width(w), aspect_ratio((double)h / (double)w),
+        row_origin(0), frame_height(h)
+        {
+        rows = new double*[height];
+        for (int i = 0; i < height; i++)
+            {
+            rows[i] = new double[width];
+            }
+        build_palette();
+        }
+
+    // Wraps caller owned storage of w*h doubles, e.g. a memory-mapped checkpoint
+    Image(int w, int h, double* pixels):
+        owns_pixels(false), height(h), width(w), aspect_ratio((double)h / (double)w),
+        row_origin(0), frame_height(h)
+        {
+        rows = new double*[height];
+        for (int i = 0; i < height; i++)
+            {
+            rows[i] = pixels + (size_t)i * width;
+            }
+        build_palette();
+        }
+
+    ~Image()
+        {
+        if (owns_pixels)
+            for (int i = 0; i < height; i++)
+                {
+                delete[] rows[i];
+                }
+        delete[] rows;
+        }
+
+    void build_palette()
+        {
+        double r, g, b;
+        for (int i = 0; i < 255; i++)
+            {
+            colours.get_colour(i, &r, &g, &b);
+            palette[3 * i + 0] = static_cast<char>(r);
+            palette[3 * i + 1] = static_cast<char>(g);
+            palette[3 * i + 2] = static_cast<char>(b);
+            }
+        }
+
+    // Makes this Image the band of rows starting at first_row of a frame
+    // full_height rows tall (and as wide as this Image)
+    void place_in_frame(int first_row, int full_height)
+        {
+        row_origin = first_row;
+        frame_height = full_height;
+        aspect_ratio = (double)full_height / (double)width;
+        }
+
+    // Zeroes the counts and forgets set_colour, so one Image can be reused
+    // for many frames. The first clear also commits the pages, on the NUMA
+    // node of the calling thread.
+    void clear()
+        {
+        for (int i = 0; i < height; i++)
+            std::fill(rows[i], rows[i] + width, 0.0);
+        smoothed.clear();
+        smoothed_rgb.clear();
+        std::fill(distances.begin(), distances.end(), 0.0f);
+        }
+
+    // Shades the PPM by distance to the set instead of the palette: black on
+    // and inside the set, white from fade_pixels away
+    void enable_distance(double fade_pixels)
+        {
+        if (distances.empty())
+            distances.assign((size_t)width * height, 0.0f);
+        fade = fade_pixels;
+        }
+
+    double distance_fade() const
+        {
+        return fade;
+        }
+
+    float* distance_row(int y)
+        {
+        return &distances[(size_t)y * width];
+        }
+
+    void display()
+        {
+        for (int i = 0; i < height; i++)
+            {
+            for (int j = 0; j < width; j++)
+                {
+                if(rows[i][j] > 0)
+                    {
+                    std::cout << "*";
+                    }
+                else
+                    {
+                    std::cout << " ";
+                    }
+                }
+            std::cout << std::endl;
+            }
+        }
+
+    void write_to_file(std::string filename)
+        {
+        // ZoneScoped;
+        ZoneScopedNC("write_to_file", tracy::Color::Green);
+        // Written under a temporary name and renamed into place, so a frame
+        // that exists on disk is always complete
+        std::string tmp = brotraw::temp_path(filename + ".ppm");
+        std::ofstream ofs(tmp, std::ios_base::out | std::ios_base::binary);
+        ofs << "P6\n" << width << ' ' << height << "\n255\n";
+
+        std::vector<unsigned char> rgb(3 * (size_t)width);
+        for (int j = 0; j < height; j++)
+            {
+            colour_rows(j, j + 1, rgb.data());
+            ofs.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+            }
+
+        ofs.close();
+        std::rename(tmp.c_str(), (filename + ".ppm").c_str());
+        }
+
+    // PPM bytes (RGB, 3 per pixel) of rows [y_first, y_last)
+    void colour_rows(int y_first, int y_last, unsigned char* rgb) const
+        {
+        std::vector<int32_t> index(width);
+        for (int j = y_first; j < y_last; j++)
+            {
+            if (!distances.empty())
+                for (int i = 0; i < width; i++)
+                    {
+                    float d = distances[(size_t)j * width + i];
+                    unsigned char grey = static_cast<unsigned char>(255 * std::min(1.0, d / fade));
+                    rgb[3 * i + 0] = grey;
+                    rgb[3 * i + 1] = grey;
+                    rgb[3 * i + 2] = grey;
+                    }
+            else
+                {
+                palette_indices(rows[j], width, index.data());
+                for (int i = 0; i < width; i++)
+                    {
+                    const unsigned char* c = &palette[3 * index[i]];
+                    rgb[3 * i + 0] = c[0];
+                    rgb[3 * i + 1] = c[1];
+                    rgb[3 * i + 2] = c[2];
+                    }
+                }
+
+            if (!smoothed.empty())
+                for (int i = 0; i < width; i++)
+                    if (smoothed[(size_t)j * width + i])
+                        {
+                        const double* smooth = &smoothed_rgb[3 * ((size_t)j * width + i)];
+                        rgb[3 * i + 0] = static_cast<char>(smooth[0] + 0.5);
+                        rgb[3 * i + 1] = static_cast<char>(smooth[1] + 0.5);
+                        rgb[3 * i + 2] = static_cast<char>(smooth[2] + 0.5);
+                        }
+            rgb += 3 * width;
+            }
+        }
+
+    void get_colour(double count, double* r, double* g, double* b) const
+        {
+        colours.get_colour((int)count%255, r, g, b);
+        }
+
+    // Overrides the palette colour of one pixel when writing a PPM
+    void set_colour(int x, int y, double r, double g, double b)
+        {
+        if (smoothed.empty())
+            {
+            smoothed.assign((size_t)width * height, 0);
+            smoothed_rgb.resize(3 * (size_t)width * height);
+            }
+        size_t i = (size_t)y * width + x;
+        smoothed[i] = 1;
+        smoothed_rgb[3 * i + 0] = r;
+        smoothed_rgb[3 * i + 1] = g;
+        smoothed_rgb[3 * i + 2] = b;
+        }
+
+    // Raw iteration counts for re-colouring later, see brotraw.hpp
+    void write_raw(std::string filename, const brotraw::Header& header)
+        {
+        ZoneScopedNC("write_raw", tracy::Color::Green);
+        brotraw::Writer writer(filename + ".pbr", header);
+
+        std::vector<uint32_t> tile(header.tile_size * header.tile_size);
+        for (int ty = 0; ty < (int)header.tiles_y; ty++)
+            for (int tx = 0; tx < (int)header.tiles_x; tx++)
+                {
+                int w = writer.tile_width(tx);
+                int h = writer.tile_height(ty);
+
+                for (int y = 0; y < h; y++)
+                    {
+                    const double* row = rows[ty * header.tile_size + y] + tx * header.tile_size;
+                    for (int x = 0; x < w; x++)
+                        tile[y * w + x] = (uint32_t)row[x];
+                    }
+                writer.write_tile(tx, ty, tile.data());
+                }
+
+        writer.close();
+        }
+
+    double* get_row_ptr(int row_idx)
+        {
+        return rows[row_idx];
+        }
+};
+
+inline int test_escape(double a, double b)
+    {
+    const int max_iter = 500;
+    double z_real = 0;
+    double z_imag = 0;
+
+    double z_real_tmp;
+
+    int iter = 0;
+    while (abs(z_real) < 2 && abs(z_imag) < 2 && iter < max_iter)
+        {
+        z_real_tmp = z_real;
+        z_real = z_real*z_real - z_imag*z_imag + a;
+        z_imag = 2*z_real_tmp*z_imag + b;
+        iter++;
+        }
+    return (double)iter / (double)max_iter;
+    }
+
+inline void populate_img(Image* img, double complex_centre, double real_centre,
+                         double complex_range, double aspect_ratio)
+    {
+    double real_range = complex_range / aspect_ratio;
+
+    double complex_start = complex_centre + complex_range / 2;
+    double complex_end = complex_centre - complex_range / 2;
+
+    double real_start = real_centre - real_range / 2;
+    double real_end = real_centre + real_range / 2;
+
+    for (int y = 0; y < img->height; y++)
+        {
+        double b = complex_start + ((double)y / img->height) * (complex_end - complex_start);
+
+        double* row = img->get_row_ptr(y);
+        for (int x = 0; x < img->width; x++)
+            {
+            double a = real_start + ((double)x / img->width) * (real_end - real_start);
+            row[x] = test_escape(a, b) * 255;
+            }
+        }
+    }
+
+// SIMD lane types for the escape kernels. Each wraps one vector of points
+// and the handful of operations the kernels need; with AVX-512 a vector is
+// 8 doubles or 16 floats, with AVX 4 doubles or 8 floats.
+#ifdef __AVX512F__
+struct DoubleLanes
+    {
+    typedef double scalar;
+    typedef __m512d vec;
+    typedef __mmask8 mask;
+    static const int width = 8;
+
+    static vec set1(double v) { return _mm512_set1_pd(v); }
+    static vec load(const double* p) { return _mm512_loadu_pd(p); }
+    static vec add(vec a, vec b) { return _mm512_add_pd(a, b); }
+    static vec mul(vec a, vec b) { return _mm512_mul_pd(a, b); }
+    static vec sub(vec a, vec b) { return _mm512_sub_pd(a, b); }
+    static void store(double* p, vec v) { _mm512_storeu_pd(p, v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_pd(a, b, c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm512_fmsub_pd(a, b, c); }
+
+    // |z|^2 > 4, with NaN (overflowed lanes) counting as escaped
+    static mask escaped(vec z_real, vec z_imag)
+        {
+        return _mm512_cmp_pd_mask(fmadd(z_real, z_real, mul(z_imag, z_imag)), set1(4.), _CMP_NLE_UQ);
+        }
+
+    // |z|^2 > limit (NaN counting as outside), and |d|^2 < limit
+    static mask exceeds(vec z_real, vec z_imag, vec limit)
+        {
+        return _mm512_cmp_pd_mask(fmadd(z_real, z_real, mul(z_imag, z_imag)), limit, _CMP_NLE_UQ);
+        }
+    static mask within(vec d_real, vec d_imag, vec limit)
+        {
+        return _mm512_cmp_pd_mask(fmadd(d_real, d_real, mul(d_imag, d_imag)), limit, _CMP_LT_OQ);
+        }
+    static int bits(mask m) { return m; }
+    static vec clear(vec v, mask m) { return _mm512_maskz_mov_pd((mask)~m, v); }
+    };
+
+struct FloatLanes
+    {
+    typedef float scalar;
+    typedef __m512 vec;
+    typedef __mmask16 mask;
+    static const int width = 16;
+
+    static vec set1(float v) { return _mm512_set1_ps(v); }
+    static vec load(const float* p) { return _mm512_loadu_ps(p); }
+    static vec add(vec a, vec b) { return _mm512_add_ps(a, b); }
+    static vec mul(vec a, vec b) { return _mm512_mul_ps(a, b); }
+    static vec sub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+    static void store(float* p, vec v) { _mm512_storeu_ps(p, v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm512_fmsub_ps(a, b, c); }
+
+    static mask escaped(vec z_real, vec z_imag)
+        {
+        return _mm512_cmp_ps_mask(fmadd(z_real, z_real, mul(z_imag, z_imag)), set1(4.f), _CMP_NLE_UQ);
+        }
+
+    static mask exceeds(vec z_real, vec z_imag, vec limit)
+        {
+        return _mm512_cmp_ps_mask(fmadd(z_real, z_real, mul(z_imag, z_imag)), limit, _CMP_NLE_UQ);
+        }
+    static mask within(vec d_real, vec d_imag, vec limit)
+        {
+        return _mm512_cmp_ps_mask(fmadd(d_real, d_real, mul(d_imag, d_imag)), limit, _CMP_LT_OQ);
+        }
+    static int bits(mask m) { return m; }
+    static vec clear(vec v, mask m) { return _mm512_maskz_mov_ps((mask)~m, v); }
+    };
+#else
+struct DoubleLanes
+    {
+    typedef double scalar;
+    typedef __m256d vec;
+    typedef __m256d mask;
+    static const int width = 4;
+
+    static vec set1(double v) { return _mm256_set1_pd(v); }
+    static vec load(const double* p) { return _mm256_loadu_pd(p); }
+    static vec add(vec a, vec b) { return _mm256_add_pd(a, b); }
+    static vec mul(vec a, vec b) { return _mm256_mul_pd(a, b); }
+    static vec sub(vec a, vec b) { return _mm256_sub_pd(a, b); }
+    static void store(double* p, vec v) { _mm256_storeu_pd(p, v); }
+#ifdef __FMA__
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_pd(a, b, c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm256_fmsub_pd(a, b, c); }
+#else
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_add_pd(_mm256_mul_pd(a, b), c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm256_sub_pd(_mm256_mul_pd(a, b), c); }
+#endif
+
+    // |z|^2 > 4, with NaN (overflowed lanes) counting as escaped
+    static mask escaped(vec z_real, vec z_imag)
+        {
+        return _mm256_cmp_pd(fmadd(z_real, z_real, mul(z_imag, z_imag)), set1(4.), _CMP_NLE_UQ);
+        }
+
+    // |z|^2 > limit (NaN counting as outside), and |d|^2 < limit
+    static mask exceeds(vec z_real, vec z_imag, vec limit)
+        {
+        return _mm256_cmp_pd(fmadd(z_real, z_real, mul(z_imag, z_imag)), limit, _CMP_NLE_UQ);
+        }
+    static mask within(vec d_real, vec d_imag, vec limit)
+        {
+        return _mm256_cmp_pd(fmadd(d_real, d_real, mul(d_imag, d_imag)), limit, _CMP_LT_OQ);
+        }
+    static int bits(mask m) { return _mm256_movemask_pd(m); }
+    static vec clear(vec v, mask m) { return _mm256_andnot_pd(m, v); }
+    };
+
+struct FloatLanes
+    {
+    typedef float scalar;
+    typedef __m256 vec;
+    typedef __m256 mask;
+    static const int width = 8;
+
+    static vec set1(float v) { return _mm256_set1_ps(v); }
+    static vec load(const float* p) { return _mm256_loadu_ps(p); }
+    static vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+    static vec mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+    static vec sub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+    static void store(float* p, vec v) { _mm256_storeu_ps(p, v); }
+#ifdef __FMA__
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm256_fmsub_ps(a, b, c); }
+#else
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+    static vec fmsub(vec a, vec b, vec c) { return _mm256_sub_ps(_mm256_mul_ps(a, b), c); }
+#endif
+
+    static mask escaped(vec z_real, vec z_imag)
+        {
+        return _mm256_cmp_ps(fmadd(z_real, z_real, mul(z_imag, z_imag)), set1(4.f), _CMP_NLE_UQ);
+        }
+
+    static mask exceeds(vec z_real, vec z_imag, vec limit)
+        {
+        return _mm256_cmp_ps(fmadd(z_real, z_real, mul(z_imag, z_imag)), limit, _CMP_NLE_UQ);
+        }
+    static mask within(vec d_real, vec d_imag, vec limit)
+        {
+        return _mm256_cmp_ps(fmadd(d_real, d_real, mul(d_imag, d_imag)), limit, _CMP_LT_OQ);
+        }
+    static int bits(mask m) { return _mm256_movemask_ps(m); }
+    static vec clear(vec v, mask m) { return _mm256_andnot_ps(m, v); }
+    };
+#endif
+
+// The fractal the escape kernels iterate, z -> z^power + c (power 2..8).
+// Multibrot sets (power 2 is the Mandelbrot set) start from z = 0 with c the
+// pixel; Julia sets start from z = the pixel with c fixed at julia_real +
+// julia_imag i. Process-wide, like kernel_config(): a job sets it once.
+struct Fractal
+    {
+    int power = 2;
+    bool julia = false;
+    double julia_real = 0;
+    double julia_imag = 0;
+    };
+
+inline Fractal& fractal()
+    {
+    static Fractal f;
+    return f;
+    }
+
+// z = z^Power in place, by the shortest chain of squarings and
+// multiplications by z (Power is small, so this is all unrolled)
+template <typename Lanes, int Power>
+inline void complex_power(typename Lanes::vec& z_real, typename Lanes::vec& z_imag)
+    {
+    typedef typename Lanes::vec vec;
+    if constexpr (Power % 2 == 0)
+        {
+        complex_power<Lanes, Power / 2>(z_real, z_imag);
+        vec z_real_tmp = z_real;
+        z_real = Lanes::fmsub(z_real, z_real, Lanes::mul(z_imag, z_imag));
+        z_imag = Lanes::mul(Lanes::add(z_real_tmp, z_real_tmp), z_imag);
+        }
+    else if constexpr (Power > 1)
+        {
+        vec w_real = z_real, w_imag = z_imag;
+        complex_power<Lanes, Power - 1>(w_real, w_imag);
+        vec z_real_tmp = z_real;
+        z_real = Lanes::fmsub(w_real, z_real, Lanes::mul(w_imag, z_imag));
+        z_imag = Lanes::fmadd(w_real, z_imag, Lanes::mul(w_imag, z_real_tmp));
+        }
+    }
+
+// z = z^Power + c with c folded into the last squaring or multiplication;
+// for Power 2 that is two FMAs and a multiply
+template <typename Lanes, int Power = 2>
+inline void escape_step(typename Lanes::vec& z_real, typename Lanes::vec& z_imag,
+                        typename Lanes::vec c_real, typename Lanes::vec c_imag)
+    {
+    typedef typename Lanes::vec vec;
+    if constexpr (Power % 2 == 0)
+        {
+        // (z^(Power/2))^2 + c
+        complex_power<Lanes, Power / 2>(z_real, z_imag);
+        vec z_real_tmp = z_real;
+        z_real = Lanes::fmsub(z_real, z_real, Lanes::fmsub(z_imag, z_imag, c_real));
+        z_imag = Lanes::fmadd(Lanes::add(z_real_tmp, z_real_tmp), z_imag, c_imag);
+        }
+    else
+        {
+        // z^(Power-1) * z + c
+        vec w_real = z_real, w_imag = z_imag;
+        complex_power<Lanes, Power - 1>(w_real, w_imag);
+        vec z_real_tmp = z_real;
+        z_real = Lanes::fmsub(w_real, z_real, Lanes::fmsub(w_imag, z_imag, c_real));
+        z_imag = Lanes::fmadd(w_real, z_imag, Lanes::fmadd(w_imag, z_real_tmp, c_imag));
+        }
+    }
+
+// Iteration counts of Interleave * Lanes::width points: the first n with
+// |z_n|^2 > 4, or max_iter for points that never escape. The points are c
+// for Multibrot sets and z_0 for Julia sets (see Fractal).
+//
+// The Interleave vectors are independent, so their dependency chains
+// overlap and hide the FMA latency. Escapes are only tested every
+// CheckEvery iterations; when any lane has escaped, the block is rolled
+// back and replayed one iteration at a time to find the exact count. An
+// escaped lane then has its z and c zeroed, which keeps it at 0 for good,
+// so it never triggers another replay.
+template <typename Lanes, int Interleave, int CheckEvery, int Power = 2, bool Julia = false>
+inline void escape_interleaved(const typename Lanes::scalar* c_real_values,
+                               const typename Lanes::scalar* c_imag_values,
+                               double* out, int max_iter)
+    {
+    typedef typename Lanes::vec vec;
+    typedef typename Lanes::scalar scalar;
+    const int width = Lanes::width;
+
+    vec z_real[Interleave], z_imag[Interleave], c_real[Interleave], c_imag[Interleave];
+    int active[Interleave];
+
+    for (int k = 0; k < Interleave; k++)
+        {
+        if constexpr (Julia)
+            {
+            z_real[k] = Lanes::load(c_real_values + k * width);
+            z_imag[k] = Lanes::load(c_imag_values + k * width);
+            c_real[k] = Lanes::set1((scalar)fractal().julia_real);
+            c_imag[k] = Lanes::set1((scalar)fractal().julia_imag);
+            }
+        else
+            {
+            z_real[k] = Lanes::set1(0);
+            z_imag[k] = Lanes::set1(0);
+            c_real[k] = Lanes::load(c_real_values + k * width);
+            c_imag[k] = Lanes::load(c_imag_values + k * width);
+            }
+        active[k] = (1 << width) - 1;
+        }
+
+    for (int i = 0; i < Interleave * width; i++)
+        out[i] = max_iter;
+
+    // A Julia start can already be outside |z| = 2, escaping at n = 0
+    if constexpr (Julia)
+        {
+        int still_active = 0;
+        for (int k = 0; k < Interleave; k++)
+            {
+            typename Lanes::mask escaped = Lanes::escaped(z_real[k], z_imag[k]);
+            int newly = Lanes::bits(escaped);
+            active[k] &= ~newly;
+            still_active |= active[k];
+            for (int lanes = newly; lanes; lanes &= lanes - 1)
+                out[k * width + __builtin_ctz(lanes)] = 0;
+
+            z_real[k] = Lanes::clear(z_real[k], escaped);
+            z_imag[k] = Lanes::clear(z_imag[k], escaped);
+            c_real[k] = Lanes::clear(c_real[k], escaped);
+            c_imag[k] = Lanes::clear(c_imag[k], escaped);
+            }
+        if (!still_active)
+            return;
+        }
+
+    int iters = 0;
+    while (iters < max_iter)
+        {
+        if (max_iter - iters >= CheckEvery)
+            {
+            vec saved_real[Interleave], saved_imag[Interleave];
+            for (int k = 0; k < Interleave; k++)
+                {
+                saved_real[k] = z_real[k];
+                saved_imag[k] = z_imag[k];
+                }
+
+            for (int step = 0; step < CheckEvery; step++)
+                for (int k = 0; k < Interleave; k++)
+                    escape_step<Lanes, Power>(z_real[k], z_imag[k], c_real[k], c_imag[k]);
+
+            int any_escaped = 0;
+            for (int k = 0; k < Interleave; k++)
+                any_escaped |= Lanes::bits(Lanes::escaped(z_real[k], z_imag[k]));
+
+            if (!any_escaped)
+                {
+                iters += CheckEvery;
+                continue;
+                }
+
+            for (int k = 0; k < Interleave; k++)
+                {
+                z_real[k] = saved_real[k];
+                z_imag[k] = saved_imag[k];
+                }
+            }
+
+        // Exact replay up to the next check
+        int steps = std::min(CheckEvery, max_iter - iters);
+        for (int step = 0; step < steps; step++)
+            {
+            iters++;
+            for (int k = 0; k < Interleave; k++)
+                {
+                escape_step<Lanes, Power>(z_real[k], z_imag[k], c_real[k], c_imag[k]);
+
+                typename Lanes::mask escaped = Lanes::escaped(z_real[k], z_imag[k]);
+                int newly = Lanes::bits(escaped) & active[k];
+                if (!newly)
+                    continue;
+
+                active[k] &= ~newly;
+                for (int lanes = newly; lanes; lanes &= lanes - 1)
+                    out[k * width + __builtin_ctz(lanes)] = iters;
+
+                z_real[k] = Lanes::clear(z_real[k], escaped);
+                z_imag[k] = Lanes::clear(z_imag[k], escaped);
+                c_real[k] = Lanes::clear(c_real[k], escaped);
+                c_imag[k] = Lanes::clear(c_imag[k], escaped);
+                }
+            }
+
+        int still_active = 0;
+        for (int k = 0; k < Interleave; k++)
+            still_active |= active[k];
+        if (!still_active)
+            return;
+        }
+    }
+
+// Interleave factors used for each precision; a job can override them. Two
+// chains was the fastest for both precisions in ParallelBrot --bench-kernels
+// on a Xeon, with AVX-512 and again built with -mno-avx512f (1.1-1.5x over
+// one chain, and ahead of three or four), so one default serves both.
+struct KernelConfig
+    {
+    int double_interleave;
+    int float_interleave;
+    };
+
+const int escape_check_every = 8;
+
+inline KernelConfig& kernel_config()
+    {
+    static KernelConfig config = {2, 2};
+    return config;
+    }
+
+template <typename Lanes>
+inline int interleave_for()
+    {
+    return sizeof(typename Lanes::scalar) == sizeof(double) ? kernel_config().double_interleave
+                                                            : kernel_config().float_interleave;
+    }
+
+template <typename Lanes, int Power, bool Julia>
+inline void escape_group_fractal(int interleave, const typename Lanes::scalar* c_real_values,
+                                 const typename Lanes::scalar* c_imag_values, double* out, int max_iter)
+    {
+    switch (interleave)
+        {
+        case 1: escape_interleaved<Lanes, 1, escape_check_every, Power, Julia>(c_real_values, c_imag_values, out, max_iter); break;
+        case 2: escape_interleaved<Lanes, 2, escape_check_every, Power, Julia>(c_real_values, c_imag_values, out, max_iter); break;
+        case 3: escape_interleaved<Lanes, 3, escape_check_every, Power, Julia>(c_real_values, c_imag_values, out, max_iter); break;
+        default: escape_interleaved<Lanes, 4, escape_check_every, Power, Julia>(c_real_values, c_imag_values, out, max_iter); break;
+        }
+    }
+
+template <typename Lanes, bool Julia>
+inline void escape_group_power(int power, int interleave, const typename Lanes::scalar* c_real_values,
+                               const typename Lanes::scalar* c_imag_values, double* out, int max_iter)
+    {
+    switch (power)
+        {
+        case 3: escape_group_fractal<Lanes, 3, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        case 4: escape_group_fractal<Lanes, 4, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        case 5: escape_group_fractal<Lanes, 5, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        case 6: escape_group_fractal<Lanes, 6, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        case 7: escape_group_fractal<Lanes, 7, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        case 8: escape_group_fractal<Lanes, 8, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        default: escape_group_fractal<Lanes, 2, Julia>(interleave, c_real_values, c_imag_values, out, max_iter); break;
+        }
+    }
+
+// escape_interleaved with a run-time interleave factor (1..4), for the
+// current fractal(); interleave * Lanes::width points are read and written.
+// Every (power, Julia) pair is its own instantiation, so the step is always
+// the unrolled chain for that power.
+template <typename Lanes>
+inline void escape_group(int interleave, const typename Lanes::scalar* c_real_values,
+                         const typename Lanes::scalar* c_imag_values, double* out, int max_iter)
+    {
+    const Fractal& f = fractal();
+    if (f.julia)
+        escape_group_power<Lanes, true>(f.power, interleave, c_real_values, c_imag_values, out, max_iter);
+    else
+        escape_group_power<Lanes, false>(f.power, interleave, c_real_values, c_imag_values, out, max_iter);
+    }
+
+// Iteration counts of any number of arbitrary points, packed into as few
+// vector groups as possible
+template <typename Lanes>
+inline void escape_points(const typename Lanes::scalar* c_real_values, const typename Lanes::scalar* c_imag_values,
+                          double* out, size_t n, int max_iter)
+    {
+    typedef typename Lanes::scalar scalar;
+    int interleave = interleave_for<Lanes>();
+    size_t group = interleave * Lanes::width;
+
+    size_t whole = n / group * group;
+    for (size_t i = 0; i < whole; i += group)
+        escape_group<Lanes>(interleave, c_real_values + i, c_imag_values + i, out + i, max_iter);
+
+    if (whole == n)
+        return;
+
+    // The last partial group is padded with copies of its final point
+    std::vector<scalar> c_real(group, c_real_values[n - 1]), c_imag(group, c_imag_values[n - 1]);
+    std::vector<double> counts(group);
+    std::copy(c_real_values + whole, c_real_values + n, c_real.begin());
+    std::copy(c_imag_values + whole, c_imag_values + n, c_imag.begin());
+    escape_group<Lanes>(interleave, c_real.data(), c_imag.data(), counts.data(), max_iter);
+    std::copy(counts.begin(), counts.begin() + (n - whole), out + whole);
+    }
+
+// The point c of every pixel of img for a viewport. Every kernel entry point
+// goes through this, so a pixel gets the same c however it is computed.
+struct PixelGrid
+    {
+    double real_start;
+    double real_range;
+    double complex_start;
+    double complex_end;
+    int width;
+    int row_origin;
+    int frame_height;
+
+    PixelGrid(const Image* img, double complex_centre, double real_centre, double complex_range):
+        real_start(real_centre - complex_range / img->aspect_ratio / 2),
+        real_range(complex_range / img->aspect_ratio),
+        complex_start(complex_centre + complex_range / 2),
+        complex_end(complex_centre - complex_range / 2),
+        width(img->width), row_origin(img->row_origin), frame_height(img->frame_height)
+        {
+        }
+
+    double real(int x) const
+        {
+        return real_start + ((double)x / width) * (real_range);
+        }
+
+    double imag(int y) const
+        {
+        return complex_start + ((double)(row_origin + y) / frame_height) * (complex_end - complex_start);
+        }
+    };
+
+// Fills rows [y_first, y_last) and columns [x_first, x_last) of img (all of
+// it by default) with the kernel for Lanes, so a frame can also be filled in
+// checkpointed bands or in tiles.
+template <typename Lanes>
+inline void populate_img_simd(Image* img, double complex_centre, double real_centre,
+                              double complex_range, int max_iter,
+                              int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    typedef typename Lanes::scalar scalar;
+
+    int interleave = interleave_for<Lanes>();
+    int group = interleave * Lanes::width;
+
+    PixelGrid grid(img, complex_centre, real_centre, complex_range);
+
+    if (y_last < 0)
+        y_last = img->height;
+    if (x_last < 0)
+        x_last = img->width;
+    int columns = x_last - x_first;
+
+    // Padded to whole groups, the padding points are computed and dropped
+    int padded = (columns + group - 1) / group * group;
+    std::vector<scalar> real_values(padded);
+    std::vector<scalar> imag_values(group);
+    std::vector<double> counts(group);
+
+    for (int x = 0; x < padded; x++)
+        {
+        real_values[x] = grid.real(x_first + std::min(x, columns - 1));
+        }
+
+    for (int y = y_first; y < y_last; y++)
+        {
+        double* row = img->get_row_ptr(y) + x_first;
+
+        std::fill(imag_values.begin(), imag_values.end(), (scalar)grid.imag(y));
+
+        for (int x = 0; x < columns; x += group)
+            {
+            escape_group<Lanes>(interleave, &real_values[x], imag_values.data(), counts.data(), max_iter);
+            std::copy(counts.begin(), counts.begin() + std::min(group, columns - x), row + x);
+            }
+        }
+    }
+
+inline void populate_img_vectorised(Image* img, double complex_centre, double real_centre,
+                                    double complex_range, int max_iter,
+                                    int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    // ZoneScoped;
+    ZoneScopedNC("populate_img_vectorised", tracy::Color::PowderBlue);
+    populate_img_simd<DoubleLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                   y_first, y_last, x_first, x_last);
+    }
+
+inline void populate_img_vectorised_float(Image* img, double complex_centre, double real_centre,
+                                          double complex_range, int max_iter,
+                                          int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    ZoneScopedNC("populate_img_vectorised_float", tracy::Color::PowderBlue);
+    populate_img_simd<FloatLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                  y_first, y_last, x_first, x_last);
+    }
+
+// Single precision is enough while a pixel is much wider than the spacing
+// of floats around the coordinates being iterated (|c| and |z| up to 2).
+// The margin keeps c exact to 1/256 of a pixel; below that more than ~0.5%
+// of boundary pixels start to come out a few iterations different.
+inline bool float_precision_enough(double complex_centre, double real_centre, double pixel_spacing)
+    {
+    const double margin = 256;
+    double magnitude = std::max(std::abs(real_centre), std::abs(complex_centre)) + 2;
+    return pixel_spacing >= margin * magnitude * std::numeric_limits<float>::epsilon();
+    }
+
+// Fills img with whichever of the float and double kernels is accurate
+// enough for this viewport
+inline void populate_img_auto(Image* img, double complex_centre, double real_centre,
+                              double complex_range, int max_iter,
+                              int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    if (float_precision_enough(complex_centre, real_centre, complex_range / img->frame_height))
+        populate_img_vectorised_float(img, complex_centre, real_centre, complex_range, max_iter,
+                                      y_first, y_last, x_first, x_last);
+    else
+        populate_img_vectorised(img, complex_centre, real_centre, complex_range, max_iter,
+                                y_first, y_last, x_first, x_last);
+    }
+
+// One image of a batch: img receives the counts of its viewport
+struct Thumbnail
+    {
+    Image* img;
+    double complex_centre;
+    double real_centre;
+    double complex_range;
+    int max_iter;
+    };
+
+// The pixels of every thumbnail in members (sorted by max_iter), packed back
+// to back into the same SIMD groups and chunks of work. A chunk is iterated
+// up to the largest max_iter in it and counts are clamped to each pixel's
+// own max_iter, which gives exactly the counts of iterating it to its own.
+template <typename Lanes>
+inline void populate_batch_simd(const std::vector<Thumbnail>& thumbnails, const std::vector<size_t>& members)
+    {
+    typedef typename Lanes::scalar scalar;
+
+    std::vector<size_t> offsets(1, 0);    // first packed pixel of each member
+    std::vector<PixelGrid> grids;
+    for (size_t t : members)
+        {
+        const Thumbnail& thumb = thumbnails[t];
+        offsets.push_back(offsets.back() + (size_t)thumb.img->width * thumb.img->height);
+        grids.emplace_back(thumb.img, thumb.complex_centre, thumb.real_centre, thumb.complex_range);
+        }
+    size_t n = offsets.back();
+
+    const size_t chunk = 4096;
+#pragma omp parallel for schedule(dynamic)
+    for (size_t first = 0; first < n; first += chunk)
+        {
+        size_t count = std::min(chunk, n - first);
+        std::vector<scalar> c_real(count), c_imag(count);
+        std::vector<double> counts(count);
+
+        // Member, row and column of the chunk's first pixel
+        size_t start = std::upper_bound(offsets.begin(), offsets.end(), first) - offsets.begin() - 1;
+        int start_y = (int)((first - offsets[start]) / grids[start].width);
+        int start_x = (int)((first - offsets[start]) % grids[start].width);
+
+        size_t m = start;
+        size_t p = 0;
+        int chunk_max_iter = 0;
+        for (int y = start_y, x = start_x; p < count; )
+            {
+            chunk_max_iter = std::max(chunk_max_iter, thumbnails[members[m]].max_iter);
+            int width = grids[m].width;
+            scalar imag = (scalar)grids[m].imag(y);
+            for (; x < width && p < count; x++, p++)
+                {
+                c_real[p] = (scalar)grids[m].real(x);
+                c_imag[p] = imag;
+                }
+            x = 0;
+            if (++y == thumbnails[members[m]].img->height)
+                {
+                y = 0;
+                m++;
+                }
+            }
+
+        escape_points<Lanes>(c_real.data(), c_imag.data(), counts.data(), count, chunk_max_iter);
+
+        m = start;
+        p = 0;
+        for (int y = start_y, x = start_x; p < count; )
+            {
+            const Thumbnail& thumb = thumbnails[members[m]];
+            double* row = thumb.img->get_row_ptr(y);
+            double limit = thumb.max_iter;
+            for (; x < thumb.img->width && p < count; x++, p++)
+                row[x] = std::min(counts[p], limit);
+            x = 0;
+            if (++y == thumb.img->height)
+                {
+                y = 0;
+                m++;
+                }
+            }
+        }
+    }
+
+// Fills many (typically small) images as one job. Thumbnails of the same
+// precision share SIMD groups and chunks of work, so the set-up and the
+// ragged last group of every row are paid per batch rather than per image.
+// Every pixel gets the count populate_img_auto would give it.
+inline void populate_batch(const std::vector<Thumbnail>& thumbnails)
+    {
+    ZoneScopedNC("populate_batch", tracy::Color::PowderBlue);
+
+    std::vector<size_t> single, dual;
+    for (size_t t = 0; t < thumbnails.size(); t++)
+        {
+        const Thumbnail& thumb = thumbnails[t];
+        if (float_precision_enough(thumb.complex_centre, thumb.real_centre,
+                                   thumb.complex_range / thumb.img->frame_height))
+            single.push_back(t);
+        else
+            dual.push_back(t);
+        }
+
+    // Neighbours in a chunk then have similar max_iter, so little is
+    // iterated past a pixel's own limit
+    auto by_max_iter = [&](size_t a, size_t b) { return thumbnails[a].max_iter < thumbnails[b].max_iter; };
+    std::stable_sort(single.begin(), single.end(), by_max_iter);
+    std::stable_sort(dual.begin(), dual.end(), by_max_iter);
+
+    if (!single.empty())
+        populate_batch_simd<FloatLanes>(thumbnails, single);
+    if (!dual.empty())
+        populate_batch_simd<DoubleLanes>(thumbnails, dual);
+    }
+
+// Distance estimation. Besides the count, these kernels carry the derivative
+// of z (by c, or by z_0 for Julia sets) to estimate each point's distance to
+// the set, and use the estimate to fill whole disks of pixels without
+// iterating them: outside the set by the Koebe 1/4 bound on the Bottcher map
+// (Milnor: sinh G / (2 e^G |G'|) < distance), inside it by the interior
+// distance of an attracting cycle found by the periodicity check.
+
+// |z|^2 at which an escaped point stops, far enough out for G to be accurate
+const double distance_bailout = 1e8;
+
+// Iterations past max_iter an escaped point may take to reach the bailout
+const int distance_extra_iterations = 64;
+
+// What the vector kernel leaves for one point
+struct DistanceOrbit
+    {
+    double count;           // as escape_interleaved
+    int bailout_iter;       // iteration |z|^2 passed distance_bailout, 0 if it never did
+    int period;             // period found by the periodicity check, 0 if none
+    double z_real, z_imag;  // z at the bailout, or near the cycle
+    double dz_real, dz_imag;
+    };
+
+// Result for one point
+struct DistancePoint
+    {
+    double count;
+    double distance;         // estimated distance to the set, 0 on or inside it
+    double exterior_radius;  // disk around the point guaranteed outside the set, 0 if none
+    double interior_radius;  // disk around the point guaranteed inside the set, 0 if none
+    };
+
+// Lanes::width points iterated with z (and dz) until they pass the bailout or
+// reach max_iter without escaping. A lane whose z comes back to the z saved
+// at the last power of two (Brent's cycle detection) has its period, z and dz
+// recorded for the interior estimate but is iterated on: a slowly escaping
+// orbit can pass that test too, so counts stay exactly escape_interleaved's
+// and a lane that escapes later loses its period. Finished lanes keep
+// iterating with the others but are no longer looked at.
+template <typename Lanes, int Power, bool Julia>
+inline void distance_orbits(const typename Lanes::scalar* c_real_values, const typename Lanes::scalar* c_imag_values,
+                            DistanceOrbit* out, int max_iter, double tolerance)
+    {
+    typedef typename Lanes::vec vec;
+    typedef typename Lanes::scalar scalar;
+    const int width = Lanes::width;
+
+    vec z_real, z_imag, c_real, c_imag, dz_real, dz_imag;
+    if constexpr (Julia)
+        {
+        z_real = Lanes::load(c_real_values);
+        z_imag = Lanes::load(c_imag_values);
+        c_real = Lanes::set1((scalar)fractal().julia_real);
+        c_imag = Lanes::set1((scalar)fractal().julia_imag);
+        dz_real = Lanes::set1(1);
+        }
+    else
+        {
+        z_real = Lanes::set1(0);
+        z_imag = Lanes::set1(0);
+        c_real = Lanes::load(c_real_values);
+        c_imag = Lanes::load(c_imag_values);
+        dz_real = Lanes::set1(0);
+        }
+    dz_imag = Lanes::set1(0);
+
+    for (int i = 0; i < width; i++)
+        out[i] = {(double)max_iter, 0, 0, 0, 0, 0, 0};
+
+    const vec power = Lanes::set1((scalar)Power);
+    const vec one = Lanes::set1(Julia ? 0 : 1);
+    const vec bailout = Lanes::set1((scalar)distance_bailout);
+    const vec tolerance2 = Lanes::set1((scalar)(tolerance * tolerance));
+
+    int counting = (1 << width) - 1;   // not yet past |z| = 2
+    int live = counting;               // still iterating
+    int looking = counting;            // no cycle found yet
+
+    // A Julia start can already be outside |z| = 2, escaping at n = 0
+    if constexpr (Julia)
+        {
+        int escaped = Lanes::bits(Lanes::escaped(z_real, z_imag));
+        for (int lanes = escaped; lanes; lanes &= lanes - 1)
+            out[__builtin_ctz(lanes)].count = 0;
+        counting &= ~escaped;
+        }
+
+    vec saved_real = z_real, saved_imag = z_imag;
+    int saved_iter = 0;
+    int save_at = 1;
+
+    for (int iters = 1; live; iters++)
+        {
+        if (iters > max_iter)
+            {
+            live &= ~counting;
+            if (!live || iters > max_iter + distance_extra_iterations)
+                break;
+            }
+
+        // dz = Power z^(Power-1) dz (+ 1 for dz/dc)
+        vec w_real = z_real, w_imag = z_imag;
+        complex_power<Lanes, Power - 1>(w_real, w_imag);
+        vec t_real = Lanes::fmsub(w_real, dz_real, Lanes::mul(w_imag, dz_imag));
+        vec t_imag = Lanes::fmadd(w_real, dz_imag, Lanes::mul(w_imag, dz_real));
+        dz_real = Lanes::fmadd(power, t_real, one);
+        dz_imag = Lanes::mul(power, t_imag);
+
+        escape_step<Lanes, Power>(z_real, z_imag, c_real, c_imag);
+
+        int escaped = Lanes::bits(Lanes::escaped(z_real, z_imag)) & counting;
+        for (int lanes = escaped; lanes; lanes &= lanes - 1)
+            out[__builtin_ctz(lanes)].count = iters;
+        counting &= ~escaped;
+
+        int done = Lanes::bits(Lanes::exceeds(z_real, z_imag, bailout)) & live;
+        int cycled = Lanes::bits(Lanes::within(Lanes::sub(z_real, saved_real), Lanes::sub(z_imag, saved_imag),
+                                               tolerance2)) & counting & looking;
+        if (done | cycled)
+            {
+            scalar zr[width], zi[width], dr[width], di[width];
+            Lanes::store(zr, z_real);
+            Lanes::store(zi, z_imag);
+            Lanes::store(dr, dz_real);
+            Lanes::store(di, dz_imag);
+            for (int lanes = done | cycled; lanes; lanes &= lanes - 1)
+                {
+                int l = __builtin_ctz(lanes);
+                out[l].z_real = zr[l];
+                out[l].z_imag = zi[l];
+                out[l].dz_real = dr[l];
+                out[l].dz_imag = di[l];
+                if (done & (1 << l))
+                    {
+                    out[l].bailout_iter = iters;
+                    out[l].period = 0;
+                    }
+                else
+                    out[l].period = iters - saved_iter;
+                }
+            looking &= ~cycled;
+            live &= ~done;
+            }
+
+        if (iters == save_at)
+            {
+            saved_real = z_real;
+            saved_imag = z_imag;
+            saved_iter = iters;
+            save_at *= 2;
+            }
+        }
+    }
+
+inline std::complex<double> complex_power(std::complex<double> z, int power)
+    {
+    std::complex<double> p = 1;
+    for (int k = 0; k < power; k++)
+        p *= z;
+    return p;
+    }
+
+// Interior distance estimate at c of the attracting cycle through (about) z:
+// the cycle point is refined by Newton's method and its shortest period
+// found, then (1 - |dz|^2) / |dc dz + dz dz dc / (1 - dz)| from the
+// derivatives of f^period there. The distance is between a quarter of it
+// and it. 0 if the cycle is not attracting.
+inline double interior_distance(std::complex<double> c, std::complex<double> z, int period, int power)
+    {
+    typedef std::complex<double> complex;
+
+    for (int step = 0; step < 16; step++)
+        {
+        complex w = z, dw = 1;
+        for (int k = 0; k < period; k++)
+            {
+            dw = (double)power * complex_power(w, power - 1) * dw;
+            w = complex_power(w, power) + c;
+            }
+        complex delta = (w - z) / (dw - 1.0);
+        z -= delta;
+        if (std::abs(delta) < 1e-15 * (1 + std::abs(z)))
+            break;
+        }
+
+    complex w = z;
+    for (int k = 1; k < period; k++)
+        {
+        w = complex_power(w, power) + c;
+        if (std::abs(w - z) < 1e-10 * (1 + std::abs(z)))
+            {
+            period = k;
+            break;
+            }
+        }
+
+    complex dz = 1, dc = 0, dzdz = 0, dcdz = 0;
+    w = z;
+    for (int k = 0; k < period; k++)
+        {
+        complex d1 = (double)power * complex_power(w, power - 1);
+        complex d2 = (double)(power * (power - 1)) * complex_power(w, power - 2);
+        dcdz = d1 * dcdz + d2 * dc * dz;
+        dzdz = d1 * dzdz + d2 * dz * dz;
+        dc = d1 * dc + 1.0;
+        dz = d1 * dz;
+        w = complex_power(w, power) + c;
+        }
+
+    if (!(std::norm(dz) < 1))
+        return 0;
+    double b = (1 - std::norm(dz)) / std::abs(dcdz + dzdz * dc / (1.0 - dz));
+    return std::isfinite(b) ? b : 0;
+    }
+
+// The exterior disk bound needs the Bottcher map to be conformal: always for
+// Multibrot sets, for Julia sets only when they are connected, i.e. when the
+// critical orbit (from 0) stays bounded
+inline bool exterior_disks_valid(const Fractal& f)
+    {
+    if (!f.julia)
+        return true;
+    std::complex<double> z = 0, c(f.julia_real, f.julia_imag);
+    for (int i = 0; i < 10000; i++)
+        {
+        z = complex_power(z, f.power) + c;
+        if (std::norm(z) > 4)
+            return false;
+        }
+    return true;
+    }
+
+// The interior bound needs the multiplier map of each hyperbolic component to
+// be conformal, which only holds for the Mandelbrot set itself
+inline bool interior_disks_valid(const Fractal& f)
+    {
+    return !f.julia && f.power == 2;
+    }
+
+inline DistancePoint finish_distance(const DistanceOrbit& orbit, double c_real, double c_imag, const Fractal& f,
+                                     bool exterior_disks, bool interior_disks)
+    {
+    DistancePoint point = {orbit.count, 0, 0, 0};
+    if (orbit.bailout_iter > 0)
+        {
+        double r = std::hypot(orbit.z_real, orbit.z_imag);
+        double log_r = std::log(r);
+        double estimate = r * log_r / std::hypot(orbit.dz_real, orbit.dz_imag);   // G / |G'|
+        if (!std::isfinite(estimate) || estimate <= 0)
+            return point;
+
+        point.distance = estimate;
+        if (exterior_disks)
+            {
+            // sinh G / (G e^G), with G over-estimated (which only shrinks
+            // the disk) for Julia sets, whose orbits start one step earlier
+            double g = log_r / std::pow((double)f.power, orbit.bailout_iter - 1);
+            double factor = g > 1e-12 ? -std::expm1(-2 * g) / (2 * g) : 1;
+            point.exterior_radius = estimate * factor / 2;
+            }
+        }
+    else if (orbit.period > 0 && interior_disks)
+        point.interior_radius = interior_distance({c_real, c_imag}, {orbit.z_real, orbit.z_imag},
+                                                  orbit.period, f.power) / 4;
+    return point;
+    }
+
+template <typename Lanes, bool Julia>
+inline void distance_orbits_power(int power, const typename Lanes::scalar* c_real_values,
+                                  const typename Lanes::scalar* c_imag_values, DistanceOrbit* out,
+                                  int max_iter, double tolerance)
+    {
+    switch (power)
+        {
+        case 3: distance_orbits<Lanes, 3, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        case 4: distance_orbits<Lanes, 4, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        case 5: distance_orbits<Lanes, 5, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        case 6: distance_orbits<Lanes, 6, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        case 7: distance_orbits<Lanes, 7, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        case 8: distance_orbits<Lanes, 8, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        default: distance_orbits<Lanes, 2, Julia>(c_real_values, c_imag_values, out, max_iter, tolerance); break;
+        }
+    }
+
+// Counts, distances and disks of any number of points for the current
+// fractal(), a vector at a time (the last one padded like escape_points)
+template <typename Lanes>
+inline void distance_points(const typename Lanes::scalar* c_real_values, const typename Lanes::scalar* c_imag_values,
+                            DistancePoint* out, size_t n, int max_iter, double tolerance,
+                            bool exterior_disks, bool interior_disks)
+    {
+    typedef typename Lanes::scalar scalar;
+    const int width = Lanes::width;
+    const Fractal& f = fractal();
+
+    scalar c_real[width], c_imag[width];
+    DistanceOrbit orbits[width];
+    for (size_t first = 0; first < n; first += width)
+        {
+        size_t count = std::min((size_t)width, n - first);
+        for (int l = 0; l < width; l++)
+            {
+            c_real[l] = c_real_values[first + std::min((size_t)l, count - 1)];
+            c_imag[l] = c_imag_values[first + std::min((size_t)l, count - 1)];
+            }
+
+        if (f.julia)
+            distance_orbits_power<Lanes, true>(f.power, c_real, c_imag, orbits, max_iter, tolerance);
+        else
+            distance_orbits_power<Lanes, false>(f.power, c_real, c_imag, orbits, max_iter, tolerance);
+
+        for (size_t l = 0; l < count; l++)
+            out[first + l] = finish_distance(orbits[l], c_real[l], c_imag[l], f, exterior_disks, interior_disks);
+        }
+    }
+
+// Fills rows [y_first, y_last) and columns [x_first, x_last) of img (all of
+// it by default) with counts and, in img's distance buffer, distances in
+// pixels. The rectangle is computed coarse to fine, on grids of spacing 16,
+// 8, ... 1; after each pass, every pixel still unknown that lies inside the
+// interior disk of a corner of its grid cell is filled as inside the set,
+// and one that lies at least 4 fade widths inside an exterior disk as far
+// outside it (shaded white however close the estimate would have put it).
+// Pixels filled that way get a count of 0 outside and max_iter inside.
+template <typename Lanes>
+inline void populate_img_distance_simd(Image* img, double complex_centre, double real_centre,
+                                       double complex_range, int max_iter,
+                                       int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    typedef typename Lanes::scalar scalar;
+
+    PixelGrid grid(img, complex_centre, real_centre, complex_range);
+
+    if (y_last < 0)
+        y_last = img->height;
+    if (x_last < 0)
+        x_last = img->width;
+    int w = x_last - x_first;
+    int h = y_last - y_first;
+
+    double pixel = complex_range / img->frame_height;
+    double fade = img->distance_fade();
+    double tolerance = std::max(pixel * 1e-3, 16 * (double)std::numeric_limits<scalar>::epsilon());
+    bool exterior_disks = exterior_disks_valid(fractal());
+    bool interior_disks = interior_disks_valid(fractal());
+
+    // Per pixel of the rectangle: whether it is known yet, and the disks
+    // around the computed ones (in pixels)
+    std::vector<unsigned char> known((size_t)w * h);
+    std::vector<float> exterior((size_t)w * h), interior((size_t)w * h);
+
+    for (int spacing = 16; spacing >= 1; spacing /= 2)
+        {
+        std::vector<int> xs, ys;
+        for (int y = 0; y < h; y += spacing)
+            for (int x = 0; x < w; x += spacing)
+                if (!known[(size_t)y * w + x])
+                    {
+                    xs.push_back(x);
+                    ys.push_back(y);
+                    }
+
+        std::vector<scalar> c_real(xs.size()), c_imag(xs.size());
+        for (size_t p = 0; p < xs.size(); p++)
+            {
+            c_real[p] = (scalar)grid.real(x_first + xs[p]);
+            c_imag[p] = (scalar)grid.imag(y_first + ys[p]);
+            }
+        std::vector<DistancePoint> points(xs.size());
+        distance_points<Lanes>(c_real.data(), c_imag.data(), points.data(), points.size(), max_iter, tolerance,
+                               exterior_disks, interior_disks);
+
+        for (size_t p = 0; p < xs.size(); p++)
+            {
+            size_t i = (size_t)ys[p] * w + xs[p];
+            known[i] = 1;
+            exterior[i] = points[p].exterior_radius / pixel;
+            interior[i] = points[p].interior_radius / pixel;
+            img->get_row_ptr(y_first + ys[p])[x_first + xs[p]] = points[p].count;
+            img->distance_row(y_first + ys[p])[x_first + xs[p]] = points[p].distance / pixel;
+            }
+
+        if (spacing == 1)
+            break;
+
+        // Only cells with a disk around one of their corners are looked at
+        for (int y0 = 0; y0 < h; y0 += spacing)
+            for (int x0 = 0; x0 < w; x0 += spacing)
+                for (int corner = 0; corner < 4; corner++)
+                    {
+                    int cx = x0 + (corner & 1) * spacing;
+                    int cy = y0 + (corner >> 1) * spacing;
+                    if (cx >= w || cy >= h)
+                        continue;
+
+                    size_t k = (size_t)cy * w + cx;
+                    if (interior[k] == 0 && exterior[k] < 4 * fade)
+                        continue;
+
+                    for (int y = y0; y < std::min(y0 + spacing, h); y++)
+                        for (int x = x0; x < std::min(x0 + spacing, w); x++)
+                            {
+                            if (known[(size_t)y * w + x])
+                                continue;
+
+                            double d = std::sqrt((double)((x - cx) * (x - cx) + (y - cy) * (y - cy)));
+                            double* count = img->get_row_ptr(y_first + y) + x_first + x;
+                            float* distance = img->distance_row(y_first + y) + x_first + x;
+                            if (interior[k] > d)
+                                {
+                                *count = max_iter;
+                                *distance = 0;
+                                }
+                            else if (exterior[k] - d >= 4 * fade)
+                                {
+                                *count = 0;
+                                *distance = exterior[k] - d;
+                                }
+                            else
+                                continue;
+
+                            known[(size_t)y * w + x] = 1;
+                            }
+                    }
+        }
+    }
+
+// populate_img_distance_simd with whichever of the float and double kernels
+// is accurate enough for this viewport. img must have distances enabled.
+inline void populate_img_distance_auto(Image* img, double complex_centre, double real_centre,
+                                       double complex_range, int max_iter,
+                                       int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    ZoneScopedNC("populate_img_distance", tracy::Color::PowderBlue);
+    if (float_precision_enough(complex_centre, real_centre, complex_range / img->frame_height))
+        populate_img_distance_simd<FloatLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                               y_first, y_last, x_first, x_last);
+    else
+        populate_img_distance_simd<DoubleLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                                y_first, y_last, x_first, x_last);
+    }
+
+// Mariani-Silver check for the tile [x_first, x_last) x [y_first, y_last):
+// iterates its whole border, pixel by pixel, and if no border pixel
+// escapes, fills the inside with max_iter without iterating it. A sampled
+// border can still miss a filament crossing it between pixels, so the fill
+// is only taken when it is also proven: the interior disks (see
+// interior_distance) of a sparse grid of samples, at most 8 pixels apart,
+// must cover every pixel inside. Points in such a disk are in the set and
+// would have counted max_iter anyway. Interior disks only hold for the
+// Mandelbrot set itself, so other fractals never fill. Returns false, with
+// the tile untouched apart from its border, if the fill was not taken.
+template <typename Lanes>
+inline bool fill_interior_simd(Image* img, double complex_centre, double real_centre,
+                               double complex_range, int max_iter,
+                               int x_first, int y_first, int x_last, int y_last)
+    {
+    typedef typename Lanes::scalar scalar;
+
+    if (!interior_disks_valid(fractal()))
+        return false;
+
+    PixelGrid grid(img, complex_centre, real_centre, complex_range);
+
+    std::vector<int> xs, ys;
+    for (int x = x_first; x < x_last; x++)
+        {
+        xs.push_back(x);
+        ys.push_back(y_first);
+        xs.push_back(x);
+        ys.push_back(y_last - 1);
+        }
+    for (int y = y_first + 1; y < y_last - 1; y++)
+        {
+        xs.push_back(x_first);
+        ys.push_back(y);
+        xs.push_back(x_last - 1);
+        ys.push_back(y);
+        }
+
+    std::vector<scalar> c_real(xs.size()), c_imag(xs.size());
+    std::vector<double> counts(xs.size());
+    for (size_t p = 0; p < xs.size(); p++)
+        {
+        c_real[p] = (scalar)grid.real(xs[p]);
+        c_imag[p] = (scalar)grid.imag(ys[p]);
+        }
+    escape_points<Lanes>(c_real.data(), c_imag.data(), counts.data(), counts.size(), max_iter);
+
+    bool interior = true;
+    for (size_t p = 0; p < xs.size(); p++)
+        {
+        img->get_row_ptr(ys[p])[xs[p]] = counts[p];
+        interior = interior && counts[p] >= max_iter;
+        }
+    if (!interior)
+        return false;
+
+    // The sample grid, including the last row and column of the tile
+    const int spacing = 8;
+    std::vector<int> sample_x, sample_y;
+    for (int x = x_first; ; x = std::min(x + spacing, x_last - 1))
+        {
+        sample_x.push_back(x);
+        if (x == x_last - 1)
+            break;
+        }
+    for (int y = y_first; ; y = std::min(y + spacing, y_last - 1))
+        {
+        sample_y.push_back(y);
+        if (y == y_last - 1)
+            break;
+        }
+
+    xs.clear();
+    ys.clear();
+    for (int y : sample_y)
+        for (int x : sample_x)
+            {
+            xs.push_back(x);
+            ys.push_back(y);
+            }
+    c_real.resize(xs.size());
+    c_imag.resize(xs.size());
+    for (size_t p = 0; p < xs.size(); p++)
+        {
+        c_real[p] = (scalar)grid.real(xs[p]);
+        c_imag[p] = (scalar)grid.imag(ys[p]);
+        }
+
+    double pixel = complex_range / img->frame_height;
+    double tolerance = std::max(pixel * 1e-3, 16 * (double)std::numeric_limits<scalar>::epsilon());
+    std::vector<DistancePoint> samples(xs.size());
+    distance_points<Lanes>(c_real.data(), c_imag.data(), samples.data(), samples.size(), max_iter, tolerance,
+                           false, true);
+
+    // Radii in pixels; each inner pixel is checked against the corners of
+    // its sample cell
+    std::vector<double> radius(samples.size());
+    for (size_t p = 0; p < samples.size(); p++)
+        radius[p] = samples[p].interior_radius / pixel;
+
+    int columns = (int)sample_x.size();
+    for (int y = y_first + 1; y < y_last - 1; y++)
+        {
+        int row = (int)(std::upper_bound(sample_y.begin(), sample_y.end(), y) - sample_y.begin()) - 1;
+        for (int x = x_first + 1; x < x_last - 1; x++)
+            {
+            int column = (int)(std::upper_bound(sample_x.begin(), sample_x.end(), x) - sample_x.begin()) - 1;
+            bool covered = false;
+            for (int corner = 0; corner < 4 && !covered; corner++)
+                {
+                int sy = std::min(row + (corner >> 1), (int)sample_y.size() - 1);
+                int sx = std::min(column + (corner & 1), columns - 1);
+                double dx = x - sample_x[sx];
+                double dy = y - sample_y[sy];
+                covered = dx * dx + dy * dy < radius[sy * columns + sx] * radius[sy * columns + sx];
+                }
+            if (!covered)
+                return false;
+            }
+        }
+
+    for (int y = y_first + 1; y < y_last - 1; y++)
+        std::fill(img->get_row_ptr(y) + x_first + 1, img->get_row_ptr(y) + x_last - 1, (double)max_iter);
+    return true;
+    }
+
+inline bool fill_interior_auto(Image* img, double complex_centre, double real_centre,
+                               double complex_range, int max_iter,
+                               int x_first, int y_first, int x_last, int y_last)
+    {
+    ZoneScopedNC("fill_interior", tracy::Color::PowderBlue);
+    if (float_precision_enough(complex_centre, real_centre, complex_range / img->frame_height))
+        return fill_interior_simd<FloatLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                              x_first, y_first, x_last, y_last);
+    return fill_interior_simd<DoubleLanes>(img, complex_centre, real_centre, complex_range, max_iter,
+                                           x_first, y_first, x_last, y_last);
+    }
+
+// Deterministic 0..1 jitter for sample s of pixel p, so re-rendering a frame
+// gives the same image
+inline double sample_jitter(uint32_t p, uint32_t s)
+    {
+    uint32_t h = p * 0x9E3779B1u ^ (s + 0x7F4A7C15u) * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return (h >> 8) / 16777216.0;
+    }
+
+// Anti-aliasing that only pays for the pixels that need it. A pixel whose
+// count differs from one of its 8 neighbours by more than threshold is
+// resampled on a jittered samples x samples grid over its footprint, and
+// gets the average colour of those samples. All other pixels keep their
+// single sample. Returns the number of pixels resampled.
+inline int antialias_edges(Image* img, double complex_centre, double real_centre,
+                           double complex_range, int max_iter, int samples, double threshold)
+    {
+    ZoneScopedNC("antialias_edges", tracy::Color::Purple);
+
+    int width = img->width;
+    int height = img->height;
+
+    double real_range = complex_range / img->aspect_ratio;
+    double complex_start = complex_centre + complex_range / 2;
+    double real_start = real_centre - real_range / 2;
+    double pixel_real = real_range / width;
+    double pixel_imag = -complex_range / img->frame_height;
+    int origin = img->row_origin;
+
+    std::vector<int> edges;
+    for (int y = 0; y < height; y++)
+        {
+        const double* row = img->get_row_ptr(y);
+        for (int x = 0; x < width; x++)
+            {
+            bool edge = false;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1) && !edge; ny++)
+                {
+                const double* neighbours = img->get_row_ptr(ny);
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++)
+                    if (std::abs(neighbours[nx] - row[x]) > threshold)
+                        {
+                        edge = true;
+                        break;
+                        }
+                }
+            if (edge)
+                edges.push_back(y * width + x);
+            }
+        }
+
+    if (edges.empty())
+        return 0;
+
+    // Samples of every edge pixel go through the SIMD kernel together
+    int per_pixel = samples * samples;
+    size_t n = edges.size() * per_pixel;
+    std::vector<double> c_real(n), c_imag(n), counts(n);
+
+    for (size_t e = 0; e < edges.size(); e++)
+        {
+        int x = edges[e] % width;
+        int y = edges[e] / width;
+        for (int sy = 0; sy < samples; sy++)
+            for (int sx = 0; sx < samples; sx++)
+                {
+                int s = sy * samples + sx;
+                uint32_t p = (uint32_t)(origin + y) * width + x;
+                double fx = (sx + sample_jitter(p, 2 * s)) / samples;
+                double fy = (sy + sample_jitter(p, 2 * s + 1)) / samples;
+                c_real[e * per_pixel + s] = real_start + (x + fx) * pixel_real;
+                c_imag[e * per_pixel + s] = complex_start + (origin + y + fy) * pixel_imag;
+                }
+        }
+    // Chunks spread over the threads when called outside a parallel region
+    const size_t chunk = 4096;
+#pragma omp parallel for schedule(dynamic)
+    for (size_t first = 0; first < n; first += chunk)
+        escape_points<DoubleLanes>(c_real.data() + first, c_imag.data() + first, counts.data() + first,
+                                   std::min(chunk, n - first), max_iter);
+
+    for (size_t e = 0; e < edges.size(); e++)
+        {
+        double r_sum = 0, g_sum = 0, b_sum = 0;
+        double r, g, b;
+        for (int s = 0; s < per_pixel; s++)
+            {
+            img->get_colour(counts[e * per_pixel + s], &r, &g, &b);
+            r_sum += r;
+            g_sum += g;
+            b_sum += b;
+            }
+        img->set_colour(edges[e] % width, edges[e] / width,
+                        r_sum / per_pixel, g_sum / per_pixel, b_sum / per_pixel);
+        }
+
+    return edges.size();
+    }
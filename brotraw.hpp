@@ -0,0 +1,444 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Raw iteration counts, so frames can be re-coloured without recomputing.
+//
+// A .pbr file is a fixed header, an index with one entry per tile, then the
+// compressed tiles in whatever order they were written. Tiles are
+// tile_size x tile_size (clipped at the right and bottom edges) and can be
+// decoded independently straight out of a read-only mapping of the file.
+//
+// Each tile is stored as the zigzag varint of every count minus its left
+// neighbour (the pixel above for the first column), then LZ compressed.
+// Interior and smooth regions become long runs of zero bytes, which the LZ
+// stage collapses to a few bytes.
+namespace brotraw
+    {
+    struct Header
+        {
+        char magic[8];
+        uint32_t width;
+        uint32_t height;
+        uint32_t tile_size;
+        uint32_t max_iter;
+        double real_centre;
+        double complex_centre;
+        double complex_range;
+        uint32_t tiles_x;
+        uint32_t tiles_y;
+        uint32_t reserved[2];
+        };
+    static_assert(sizeof(Header) == 64, "Header is part of the file format");
+
+    struct TileEntry
+        {
+        uint64_t offset;
+        uint32_t bytes;
+        uint32_t reserved;
+        };
+
+    inline const char* magic()
+        {
+        return "PBRAW1";
+        }
+
+    // Where to write path before renaming it into place. Unique per process
+    // across hosts, so farm workers that end up on the same frame never
+    // write into each other's file.
+    inline std::string temp_path(const std::string& path)
+        {
+        char host[256] = "localhost";
+        gethostname(host, sizeof(host) - 1);
+        return path + ".tmp." + host + "." + std::to_string(getpid());
+        }
+
+    inline Header make_header(int width, int height, int tile_size, int max_iter,
+                              double real_centre, double complex_centre, double complex_range)
+        {
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::strncpy(h.magic, magic(), sizeof(h.magic));
+        h.width = width;
+        h.height = height;
+        h.tile_size = tile_size;
+        h.max_iter = max_iter;
+        h.real_centre = real_centre;
+        h.complex_centre = complex_centre;
+        h.complex_range = complex_range;
+        h.tiles_x = (width + tile_size - 1) / tile_size;
+        h.tiles_y = (height + tile_size - 1) / tile_size;
+        return h;
+        }
+
+
+    // A small LZ77 in the style of LZ4: sequences of
+    //   token (literal length << 4 | match length - 4), [length bytes],
+    //   literals, 16 bit offset, [length bytes]
+    // where a nibble of 15 continues in following bytes of 255. The last
+    // sequence carries only literals.
+    namespace lz
+        {
+        const int min_match = 4;
+        const int hash_bits = 12;
+
+        inline uint32_t read32(const uint8_t* p)
+            {
+            uint32_t v;
+            std::memcpy(&v, p, 4);
+            return v;
+            }
+
+        inline void put_length(std::vector<uint8_t>& out, size_t len)
+            {
+            while (len >= 255)
+                {
+                out.push_back(255);
+                len -= 255;
+                }
+            out.push_back((uint8_t)len);
+            }
+
+        inline void put_sequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literal_len,
+                                 size_t offset, size_t match_len)
+            {
+            size_t match_code = match_len ? match_len - min_match : 0;
+            out.push_back((uint8_t)((std::min<size_t>(literal_len, 15) << 4) | std::min<size_t>(match_code, 15)));
+            if (literal_len >= 15)
+                put_length(out, literal_len - 15);
+            out.insert(out.end(), literals, literals + literal_len);
+
+            if (!match_len)
+                return;
+
+            out.push_back((uint8_t)offset);
+            out.push_back((uint8_t)(offset >> 8));
+            if (match_code >= 15)
+                put_length(out, match_code - 15);
+            }
+
+        inline void compress(const uint8_t* in, size_t n, std::vector<uint8_t>& out)
+            {
+            int32_t table[1 << hash_bits];
+            std::fill(table, table + (1 << hash_bits), -1);
+
+            size_t anchor = 0;
+            size_t i = 0;
+            while (i + min_match <= n)
+                {
+                uint32_t seq = read32(in + i);
+                uint32_t h = (seq * 2654435761u) >> (32 - hash_bits);
+                int32_t ref = table[h];
+                table[h] = (int32_t)i;
+
+                if (ref < 0 || i - ref > 65535 || read32(in + ref) != seq)
+                    {
+                    i++;
+                    continue;
+                    }
+
+                size_t len = min_match;
+                while (i + len < n && in[ref + len] == in[i + len])
+                    len++;
+
+                put_sequence(out, in + anchor, i - anchor, i - ref, len);
+                i += len;
+                anchor = i;
+                }
+
+            put_sequence(out, in + anchor, n - anchor, 0, 0);
+            }
+
+        // Returns false on corrupt input rather than reading out of bounds
+        inline bool decompress(const uint8_t* in, size_t n, std::vector<uint8_t>& out)
+            {
+            out.clear();
+            size_t i = 0;
+
+            auto get_length = [&](size_t len, bool& ok)
+                {
+                if (len < 15)
+                    return len;
+                uint8_t b;
+                do
+                    {
+                    if (i >= n)
+                        {
+                        ok = false;
+                        return len;
+                        }
+                    b = in[i++];
+                    len += b;
+                    }
+                while (b == 255);
+                return len;
+                };
+
+            while (i < n)
+                {
+                bool ok = true;
+                uint8_t token = in[i++];
+
+                size_t literal_len = get_length(token >> 4, ok);
+                if (!ok || i + literal_len > n)
+                    return false;
+                out.insert(out.end(), in + i, in + i + literal_len);
+                i += literal_len;
+
+                if (i == n)
+                    break;
+
+                if (i + 2 > n)
+                    return false;
+                size_t offset = in[i] | (in[i + 1] << 8);
+                i += 2;
+
+                size_t match_len = get_length(token & 15, ok) + min_match;
+                if (!ok || offset == 0 || offset > out.size())
+                    return false;
+
+                // Byte by byte, matches may overlap what they copy
+                size_t from = out.size() - offset;
+                for (size_t k = 0; k < match_len; k++)
+                    out.push_back(out[from + k]);
+                }
+            return true;
+            }
+        }
+
+
+    inline void encode_tile(const uint32_t* counts, int w, int h, std::vector<uint8_t>& varints,
+                            std::vector<uint8_t>& out)
+        {
+        varints.clear();
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                {
+                uint32_t pred = x > 0 ? counts[y * w + x - 1] : (y > 0 ? counts[(y - 1) * w] : 0);
+                int32_t delta = (int32_t)(counts[y * w + x] - pred);
+                uint32_t zz = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+                while (zz >= 0x80)
+                    {
+                    varints.push_back((uint8_t)(zz | 0x80));
+                    zz >>= 7;
+                    }
+                varints.push_back((uint8_t)zz);
+                }
+
+        out.clear();
+        lz::compress(varints.data(), varints.size(), out);
+        }
+
+    inline bool decode_tile(const uint8_t* data, size_t bytes, int w, int h, std::vector<uint8_t>& varints,
+                            uint32_t* counts)
+        {
+        if (!lz::decompress(data, bytes, varints))
+            return false;
+
+        size_t i = 0;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                {
+                uint32_t zz = 0;
+                int shift = 0;
+                while (true)
+                    {
+                    if (i >= varints.size() || shift > 28)
+                        return false;
+                    uint8_t b = varints[i++];
+                    zz |= (uint32_t)(b & 0x7f) << shift;
+                    shift += 7;
+                    if (!(b & 0x80))
+                        break;
+                    }
+
+                int32_t delta = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+                uint32_t pred = x > 0 ? counts[y * w + x - 1] : (y > 0 ? counts[(y - 1) * w] : 0);
+                counts[y * w + x] = pred + (uint32_t)delta;
+                }
+        return i == varints.size();
+        }
+
+
+    // Tiles may be added in any order; the index is written by close(), and
+    // the file only appears under its final name once it is complete.
+    class Writer
+        {
+    private:
+        Header header;
+        std::vector<TileEntry> index;
+        std::string path;
+        std::string tmp;
+        std::ofstream ofs;
+        uint64_t offset;
+        std::vector<uint8_t> varints;
+        std::vector<uint8_t> packed;
+
+    public:
+        Writer(const std::string& filename, const Header& h):
+            header(h), index(h.tiles_x * h.tiles_y), path(filename), tmp(temp_path(filename)),
+            ofs(tmp, std::ios_base::out | std::ios_base::binary)
+            {
+            std::memset(index.data(), 0, index.size() * sizeof(TileEntry));
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ofs.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TileEntry));
+            offset = sizeof(header) + index.size() * sizeof(TileEntry);
+            }
+
+        int tile_width(int tx) const
+            {
+            return std::min(header.tile_size, header.width - tx * header.tile_size);
+            }
+
+        int tile_height(int ty) const
+            {
+            return std::min(header.tile_size, header.height - ty * header.tile_size);
+            }
+
+        // counts is tile_width(tx) x tile_height(ty), row-major
+        void write_tile(int tx, int ty, const uint32_t* counts)
+            {
+            encode_tile(counts, tile_width(tx), tile_height(ty), varints, packed);
+            write_encoded(tx, ty, packed.data(), packed.size());
+            }
+
+        // For callers that compress tiles on their own threads
+        void write_encoded(int tx, int ty, const uint8_t* data, size_t bytes)
+            {
+            TileEntry& e = index[ty * header.tiles_x + tx];
+            e.offset = offset;
+            e.bytes = bytes;
+            ofs.write(reinterpret_cast<const char*>(data), bytes);
+            offset += bytes;
+            }
+
+        void close()
+            {
+            ofs.seekp(sizeof(header));
+            ofs.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TileEntry));
+            ofs.close();
+            std::rename(tmp.c_str(), path.c_str());
+            }
+        };
+
+
+    // Read-only mapping of a .pbr file; tiles are decoded on demand.
+    class Reader
+        {
+    private:
+        const uint8_t* data;
+        size_t size;
+        const TileEntry* index;
+
+    public:
+        Header header;
+
+        explicit Reader(const std::string& path):
+            data(nullptr), size(0), index(nullptr)
+            {
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header))
+                {
+                std::cerr << "Error opening raw frame: " << path << std::endl;
+                exit(1);
+                }
+            size = st.st_size;
+
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED)
+                {
+                std::cerr << "Error mapping raw frame: " << path << std::endl;
+                exit(1);
+                }
+            data = static_cast<const uint8_t*>(mapped);
+
+            std::memcpy(&header, data, sizeof(header));
+            size_t tiles = (size_t)header.tiles_x * header.tiles_y;
+            if (std::strncmp(header.magic, magic(), sizeof(header.magic)) != 0 ||
+                header.tile_size == 0 ||
+                tiles != (size_t)((header.width + header.tile_size - 1) / header.tile_size) *
+                         ((header.height + header.tile_size - 1) / header.tile_size) ||
+                size < sizeof(Header) + tiles * sizeof(TileEntry))
+                {
+                std::cerr << "Not a raw frame: " << path << std::endl;
+                exit(1);
+                }
+            index = reinterpret_cast<const TileEntry*>(data + sizeof(Header));
+            }
+
+        ~Reader()
+            {
+            munmap(const_cast<uint8_t*>(data), size);
+            }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        int tile_width(int tx) const
+            {
+            return std::min(header.tile_size, header.width - tx * header.tile_size);
+            }
+
+        int tile_height(int ty) const
+            {
+            return std::min(header.tile_size, header.height - ty * header.tile_size);
+            }
+
+        // Decodes one tile into counts (tile_width x tile_height, row-major)
+        bool read_tile(int tx, int ty, uint32_t* counts, std::vector<uint8_t>& scratch) const
+            {
+            const TileEntry& e = index[ty * header.tiles_x + tx];
+            if (e.offset + e.bytes > size)
+                return false;
+            return decode_tile(data + e.offset, e.bytes, tile_width(tx), tile_height(ty), scratch, counts);
+            }
+
+        // Decodes the whole frame into counts (width x height, row-major)
+        bool read_frame(uint32_t* counts) const
+            {
+            bool ok = true;
+
+#pragma omp parallel
+            {
+            std::vector<uint8_t> scratch;
+            std::vector<uint32_t> tile(header.tile_size * header.tile_size);
+
+#pragma omp for schedule(dynamic,1) reduction(&&:ok)
+            for (int t = 0; t < (int)(header.tiles_x * header.tiles_y); t++)
+                {
+                int tx = t % header.tiles_x;
+                int ty = t / header.tiles_x;
+                int w = tile_width(tx);
+                int h = tile_height(ty);
+
+                if (!read_tile(tx, ty, tile.data(), scratch))
+                    {
+                    ok = false;
+                    continue;
+                    }
+
+                for (int y = 0; y < h; y++)
+                    std::memcpy(counts + (size_t)(ty * header.tile_size + y) * header.width + tx * header.tile_size,
+                                tile.data() + y * w, w * sizeof(uint32_t));
+                }
+            }
+            return ok;
+            }
+        };
+    }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+
+// Maps a palette index 0..255 to a colour by linear interpolation between
+// gradient stops (positions 0..1 with an RGB value each).
+class Colour
+    {
+private:
+    double map_r[256];
+    double map_g[256];
+    double map_b[256];
+
+public:
+    Colour():
+        Colour({0.0, 0.16, 0.42, 0.6425, 0.8575, 1.0},
+               {0, 32, 237, 255, 0, 0},
+               {7, 107, 255, 170, 2, 0},
+               {100, 203, 255, 0, 0, 0})
+        {
+        }
+
+    Colour(const std::vector<double>& stops, const std::vector<double>& reds,
+           const std::vector<double>& greens, const std::vector<double>& blues)
+        {
+        int n = stops.size();
+
+        for (int i = 0; i < 256; i++)
+            {
+            double pos = static_cast<double>(i) / 255.0;
+
+            int stop = std::upper_bound(stops.begin(), stops.end(), pos) - stops.begin() - 1;
+
+            if (stop < 0)
+                stop = 0;
+            if (stop >= n - 1)
+                stop = n - 2;
+
+            double start = stops[stop];
+            double end = stops[stop + 1];
+            double range = end - start;
+            double factor = (pos - start) / range;
+
+            // Linear interpolation
+            map_r[i] = (1 - factor) * reds[stop] + factor * reds[stop + 1];
+            map_g[i] = (1 - factor) * greens[stop] + factor * greens[stop + 1];
+            map_b[i] = (1 - factor) * blues[stop] + factor * blues[stop + 1];
+            }
+        }
+
+    void get_colour(int i, double *r, double *g, double *b) const
+        {
+        if (i < 0) i = 0;
+        if (i > 255) i = 255;
+
+        *r = map_r[i];
+        *g = map_g[i];
+        *b = map_b[i];
+        }
+    };
@@ -1,13 +1,42 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include <immintrin.h>
+#include <omp.h>
 #include <valarray>
 
 #define TRACY_ENABLE
 #include "Tracy.hpp"
 
+#include "brot.hpp"
+#include "numa.hpp"
+#include "pipeline.hpp"
+
 
 void print(__m256d vec)
     {
@@ -38,296 +67,1543 @@ void print(double* arr, int len)
     }
 
 
-class Colour
+struct Keyframe
     {
-private:
-    double map_r[256];
-    double map_g[256];
-    double map_b[256];
+    int frame;
+    double real_centre;
+    double complex_centre;
+    double complex_range;   // <= 0 means follow zoom_ratio from the previous keyframe
+    };
 
+// Everything needed to render a zoom, either read from a job file or the
+// defaults below (the original hard-coded 250 frame zoom).
+//
+//   # comments and blank lines are ignored
+//   width = 3840
+//   height = 2160
+//   frames = 10000
+//   range = 3                  complex range of frame 0
+//   zoom_ratio = 0.9           range multiplier per frame
+//   iterations = auto          or a fixed count
+//   iteration_scale = 100      auto: scale * sqrt(3 / range)
+//   output = ../outputs/       directory (or prefix) frames are written to
+//   format = ppm               ppm, or raw for re-colourable iteration counts (see Recolour)
+//   tile_size = 64             tile edge of raw frames
+//   antialias = 4              supersample edge pixels on a 4x4 jittered grid (0 = off)
+//   antialias_threshold = 4    count difference to a neighbour that makes a pixel an edge
+//   interleave = 4 2           vectors in flight in the double and float kernels (1..4)
+//   fractal = mandelbrot       or julia <real> <imag> for the Julia set of that c
+//   power = 2                  z -> z^power + c, 2..8 (Multibrot and multi-Julia sets)
+//   distance = 0               shade by estimated distance to the set, white from this
+//                              many pixels away, filling disks known to be outside or
+//                              inside the set without iterating them (0 = off, ppm only)
+//   chunk = 10                 frames per lease in farm mode
+//   lease_timeout = 60         seconds without a heartbeat before a lease is retried
+//   checkpoint = on            record progress so a killed run resumes where it stopped
+//   checkpoint_band = 16       rows per checkpointed band within a frame
+//   pin_threads = on           pin render threads to CPUs, spread over NUMA nodes
+//   stream = on                render each frame in bands written out as they finish,
+//                              so memory does not grow with the height (large stills)
+//   stream_band = 64           rows per band when streaming (rounded up to whole raw tiles)
+//   schedule = frames          frames: one frame per thread at a time; tiles: one frame at
+//                              a time split into tiles, ordered by cost predicted from
+//                              the frame before (best when frames are few or uneven)
+//   schedule_tile = 32         tile edge for schedule = tiles
+//   keyframe = 0 -1.7499 0.0
+//   keyframe = 9999 -1.7499 0.0 1e-12
+class Job
+    {
 public:
-    Colour()
+    int width = 600;
+    int height = 400;
+    int frames = 250;
+    double start_range = 3;
+    double zoom_ratio = 0.9;
+    int fixed_iterations = 0;
+    double iteration_scale = 100;
+    std::string output = "../outputs/";
+    std::string format = "ppm";
+    int tile_size = 64;
+    int antialias = 0;
+    double antialias_threshold = 4;
+    double distance = 0;
+    int chunk = 10;
+    int lease_timeout = 60;
+    bool checkpoint = false;
+    int checkpoint_band = 16;
+    bool pin_threads = true;
+    bool stream = false;
+    int stream_band = 64;
+    std::string schedule = "frames";
+    int schedule_tile = 32;
+    std::vector<Keyframe> keyframes;
+
+    Job()
         {
-        double stops[] = {0.0, 0.16, 0.42, 0.6425, 0.8575, 1.0};
-        double reds[] = {0, 32, 237, 255, 0, 0};
-        double greens[] = {7, 107, 255, 170, 2, 0};
-        double blues[] = {100, 203, 255, 0, 0, 0};
+        keyframes.push_back({0,
+            -1.74995768370609350360221450607069970727110579726252077930242837820286008082972804887218672784431700831100544507655659531379747541999999995,
+            0.00000000000000000278793706563379402178294753790944364927085054500163081379043930650189386849765202169477470552201325772332454726999999995,
+            0});
+        }
 
-        for (int i = 0; i < 256; i++)
+    static Job load(const std::string& path)
+        {
+        std::ifstream ifs(path);
+        if (!ifs.is_open())
             {
-            double pos = static_cast<double>(i) / 255.0;
+            std::cerr << "Error opening job file: " << path << std::endl;
+            exit(1);
+            }
 
-            int stop = std::upper_bound(stops, stops + 6, pos) - stops - 1;
+        Job job;
+        job.keyframes.clear();
 
-            if (stop < 0)
-                stop = 0;
-            if (stop >= 5)
-                stop = 4;
+        std::string line;
+        int line_no = 0;
+        while (std::getline(ifs, line))
+            {
+            line_no++;
+            line = line.substr(0, line.find('#'));
 
-            double start = stops[stop];
-            double end = stops[stop + 1];
-            double range = end - start;
-            double factor = (pos - start) / range;
+            size_t eq = line.find('=');
+            if (eq == std::string::npos)
+                {
+                if (line.find_first_not_of(" \t\r") != std::string::npos)
+                    job_error(path, line_no, "expected key = value");
+                continue;
+                }
 
-            // Linear interpolation
-            map_r[i] = (1 - factor) * reds[stop] + factor * reds[stop + 1];
-            map_g[i] = (1 - factor) * greens[stop] + factor * greens[stop + 1];
-            map_b[i] = (1 - factor) * blues[stop] + factor * blues[stop + 1];
+            std::string key;
+            std::istringstream(line.substr(0, eq)) >> key;
+            std::istringstream value(line.substr(eq + 1));
+
+            bool ok = true;
+            if (key == "width") ok = static_cast<bool>(value >> job.width);
+            else if (key == "height") ok = static_cast<bool>(value >> job.height);
+            else if (key == "frames") ok = static_cast<bool>(value >> job.frames);
+            else if (key == "range") ok = static_cast<bool>(value >> job.start_range);
+            else if (key == "zoom_ratio") ok = static_cast<bool>(value >> job.zoom_ratio);
+            else if (key == "iteration_scale") ok = static_cast<bool>(value >> job.iteration_scale);
+            else if (key == "output") ok = static_cast<bool>(value >> job.output);
+            else if (key == "format") ok = static_cast<bool>(value >> job.format);
+            else if (key == "tile_size") ok = static_cast<bool>(value >> job.tile_size);
+            else if (key == "antialias") ok = static_cast<bool>(value >> job.antialias);
+            else if (key == "antialias_threshold") ok = static_cast<bool>(value >> job.antialias_threshold);
+            else if (key == "interleave")
+                {
+                KernelConfig& config = kernel_config();
+                ok = static_cast<bool>(value >> config.double_interleave >> config.float_interleave) &&
+                     config.double_interleave >= 1 && config.double_interleave <= 4 &&
+                     config.float_interleave >= 1 && config.float_interleave <= 4;
+                }
+            else if (key == "fractal")
+                {
+                Fractal& f = fractal();
+                std::string kind;
+                ok = static_cast<bool>(value >> kind) && (kind == "mandelbrot" || kind == "julia");
+                f.julia = kind == "julia";
+                if (ok && f.julia)
+                    ok = static_cast<bool>(value >> f.julia_real >> f.julia_imag);
+                }
+            else if (key == "power")
+                {
+                Fractal& f = fractal();
+                ok = static_cast<bool>(value >> f.power) && f.power >= 2 && f.power <= 8;
+                }
+            else if (key == "distance") ok = static_cast<bool>(value >> job.distance) && job.distance >= 0;
+            else if (key == "chunk") ok = static_cast<bool>(value >> job.chunk);
+            else if (key == "lease_timeout") ok = static_cast<bool>(value >> job.lease_timeout);
+            else if (key == "checkpoint_band") ok = static_cast<bool>(value >> job.checkpoint_band);
+            else if (key == "checkpoint")
+                {
+                std::string flag;
+                ok = static_cast<bool>(value >> flag);
+                job.checkpoint = flag == "on" || flag == "true" || flag == "1";
+                }
+            else if (key == "schedule") ok = static_cast<bool>(value >> job.schedule);
+            else if (key == "schedule_tile") ok = static_cast<bool>(value >> job.schedule_tile) && job.schedule_tile >= 3;
+            else if (key == "stream_band") ok = static_cast<bool>(value >> job.stream_band) && job.stream_band > 0;
+            else if (key == "stream")
+                {
+                std::string flag;
+                ok = static_cast<bool>(value >> flag);
+                job.stream = flag == "on" || flag == "true" || flag == "1";
+                }
+            else if (key == "pin_threads")
+                {
+                std::string flag;
+                ok = static_cast<bool>(value >> flag);
+                job.pin_threads = flag == "on" || flag == "true" || flag == "1";
+                }
+            else if (key == "iterations")
+                {
+                std::string policy;
+                ok = static_cast<bool>(value >> policy);
+                job.fixed_iterations = policy == "auto" ? 0 : std::atoi(policy.c_str());
+                }
+            else if (key == "keyframe")
+                {
+                Keyframe k = {0, 0, 0, 0};
+                ok = static_cast<bool>(value >> k.frame >> k.real_centre >> k.complex_centre);
+                value >> k.complex_range;
+                job.keyframes.push_back(k);
+                }
+            else
+                job_error(path, line_no, "unknown key '" + key + "'");
+
+            if (!ok)
+                job_error(path, line_no, "bad value for '" + key + "'");
             }
+
+        if (job.keyframes.empty())
+            job.keyframes = Job().keyframes;
+
+        std::sort(job.keyframes.begin(), job.keyframes.end(),
+                  [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+
+        if (job.width <= 0 || job.height <= 0 || job.frames <= 0 || job.chunk <= 0 ||
+            job.checkpoint_band <= 0 || job.tile_size <= 0)
+            job_error(path, line_no, "width, height, frames, chunk, checkpoint_band and tile_size must be positive");
+
+        if (job.format != "ppm" && job.format != "raw")
+            job_error(path, line_no, "format must be ppm or raw");
+
+        if (job.schedule != "frames" && job.schedule != "tiles")
+            job_error(path, line_no, "schedule must be frames or tiles");
+
+        // Streamed frames never exist whole, so there is nothing to checkpoint
+        if (job.stream && job.checkpoint)
+            job_error(path, line_no, "stream and checkpoint cannot both be on");
+
+        // Distances are neither checkpointed nor stored in raw frames, and
+        // supersampling would colour over them
+        if (job.distance > 0 && (job.checkpoint || job.format != "ppm" || job.antialias > 1))
+            job_error(path, line_no, "distance needs format = ppm, with checkpoint and antialias off");
+
+        return job;
         }
 
-    void get_colour(int i, double *r, double *g, double *b) const
+    // Centre and range for frame i. Centres are interpolated linearly between
+    // keyframes, ranges geometrically so the zoom speed stays constant.
+    void frame_viewport(int i, double* complex_centre, double* real_centre, double* complex_range) const
         {
-        if (i < 0) i = 0;
-        if (i > 255) i = 255;
+        size_t k = 0;
+        while (k + 1 < keyframes.size() && keyframes[k + 1].frame <= i)
+            k++;
+
+        double range_k = range_at(k);
+        const Keyframe& a = keyframes[k];
 
-        *r = map_r[i];
-        *g = map_g[i];
-        *b = map_b[i];
+        if (k + 1 == keyframes.size() || i <= a.frame)
+            {
+            *real_centre = a.real_centre;
+            *complex_centre = a.complex_centre;
+            *complex_range = range_k * std::pow(zoom_ratio, i - a.frame);
+            return;
+            }
+
+        const Keyframe& b = keyframes[k + 1];
+        double t = (double)(i - a.frame) / (double)(b.frame - a.frame);
+
+        *real_centre = a.real_centre + t * (b.real_centre - a.real_centre);
+        *complex_centre = a.complex_centre + t * (b.complex_centre - a.complex_centre);
+        *complex_range = range_k * std::pow(range_at(k + 1) / range_k, t);
+        }
+
+    int iterations(double complex_range) const
+        {
+        if (fixed_iterations > 0)
+            return fixed_iterations;
+        return iteration_scale * sqrt(3. / complex_range);
+        }
+
+    std::string frame_path(int i) const
+        {
+        return output + std::to_string(i);
+        }
+
+    // FNV-1a hash of every setting that changes a frame's pixels or the
+    // layout of its checkpoint, so saved progress is only reused by the job
+    // that saved it
+    uint64_t fingerprint() const
+        {
+        const Fractal& f = fractal();
+        std::ostringstream settings;
+        settings.precision(17);
+        settings << width << ' ' << height << ' ' << frames << ' ' << start_range << ' ' << zoom_ratio << ' '
+                 << fixed_iterations << ' ' << iteration_scale << ' ' << format << ' ' << tile_size << ' '
+                 << antialias << ' ' << antialias_threshold << ' ' << distance << ' ' << checkpoint_band << ' '
+                 << schedule << ' ' << schedule_tile << ' '
+                 << f.power << ' ' << f.julia << ' ' << f.julia_real << ' ' << f.julia_imag;
+        for (const Keyframe& k : keyframes)
+            settings << ' ' << k.frame << ' ' << k.real_centre << ' ' << k.complex_centre << ' ' << k.complex_range;
+
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : settings.str())
+            {
+            hash ^= c;
+            hash *= 1099511628211ull;
+            }
+        return hash;
+        }
+
+private:
+    double range_at(size_t k) const
+        {
+        double range = start_range;
+        int frame = 0;
+        for (size_t j = 0; j <= k; j++)
+            {
+            if (keyframes[j].complex_range > 0)
+                range = keyframes[j].complex_range;
+            else
+                range *= std::pow(zoom_ratio, keyframes[j].frame - frame);
+            frame = keyframes[j].frame;
+            }
+        return range;
+        }
+
+public:
+    // Also used for other line-based inputs, e.g. thumbnail lists
+    static void job_error(const std::string& path, int line_no, const std::string& msg)
+        {
+        std::cerr << path << ":" << line_no << ": " << msg << std::endl;
+        exit(1);
         }
     };
 
+// A file mapped MAP_SHARED, so every store lands in the page cache straight
+// away and survives the process being killed.
+class MappedFile
+    {
+private:
+    void* data;
+    size_t size;
+
+public:
+    bool created;
+
+    MappedFile(const std::string& path, size_t bytes):
+        data(nullptr), size(bytes), created(false)
+        {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            {
+            std::cerr << "Error opening checkpoint: " << path << std::endl;
+            exit(1);
+            }
+
+        // A file of the wrong size belongs to a different job, start it over
+        if ((size_t)st.st_size != size)
+            {
+            created = true;
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+                {
+                std::cerr << "Error sizing checkpoint: " << path << std::endl;
+                exit(1);
+                }
+            }
+
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            {
+            std::cerr << "Error mapping checkpoint: " << path << std::endl;
+            exit(1);
+            }
+        }
+
+    ~MappedFile()
+        {
+        munmap(data, size);
+        }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-class Image {
+    unsigned char* bytes()
+        {
+        return static_cast<unsigned char*>(data);
+        }
+
+    void flush()
+        {
+        msync(data, size, MS_ASYNC);
+        }
+    };
+
+// Which frames of a job are finished: a marker file per frame holding the
+// job's fingerprint, written under a temporary name and renamed into place.
+// Shared by every process of a farm working on the job, so a requeued range
+// skips the frames its previous owner already wrote. Separate files rather
+// than one shared mapping, since writes to a mapping are not coherent
+// between hosts on NFS and a mark could be lost. A marker left by a
+// different job does not count, so changing the job redoes its frames.
+class Manifest
+    {
 private:
-    Colour colours;
-    double** rows;
+    const Job& job;
+    std::string fingerprint;
+
+    std::string marker(int frame) const
+        {
+        return job.frame_path(frame) + ".done";
+        }
 
 public:
-    int height;
-    int width;
-    double aspect_ratio;
+    explicit Manifest(const Job& job):
+        job(job)
+        {
+        std::ostringstream hex;
+        hex << std::hex << job.fingerprint();
+        fingerprint = hex.str();
+        }
+
+    bool done(int frame) const
+        {
+        std::ifstream ifs(marker(frame));
+        std::string recorded;
+        return ifs >> recorded && recorded == fingerprint;
+        }
 
-    Image(int w, int h):
-        height(h), width(w), aspect_ratio((double)h / (double)w)
+    void mark_done(int frame)
         {
-        rows = new double*[height];
-        for (int i = 0; i < height; i++)
+        std::string tmp = brotraw::temp_path(marker(frame));
             {
-            rows[i] = new double[width];
+            std::ofstream ofs(tmp);
+            ofs << fingerprint << std::endl;
             }
+        std::rename(tmp.c_str(), marker(frame).c_str());
+        }
+    };
+
+// The iteration counts of a frame in progress, with a flag per band of rows.
+// Completed bands are kept when the run is killed and not recomputed, as
+// long as the job's fingerprint is unchanged.
+class FrameCheckpoint
+    {
+private:
+    struct Header
+        {
+        char magic[8];
+        uint64_t fingerprint;
+        };
+
+    size_t header_bytes;
+    MappedFile file;
+
+    // The header and one flag byte per band, padded so the pixels stay
+    // cache line aligned
+    static size_t flag_bytes(int height, int band_rows)
+        {
+        size_t bands = (height + band_rows - 1) / band_rows;
+        return (sizeof(Header) + bands + 63) / 64 * 64;
         }
 
-    ~Image()
+public:
+    FrameCheckpoint(const std::string& path, int width, int height, int band_rows, uint64_t fingerprint):
+        header_bytes(flag_bytes(height, band_rows)),
+        file(path, header_bytes + (size_t)width * height * sizeof(double))
         {
-        for (int i = 0; i < height; i++)
+        // Bands saved by a different job are discarded
+        Header expected = {{'P', 'B', 'P', 'A', 'R', 'T', '1', 0}, fingerprint};
+        if (std::memcmp(file.bytes(), &expected, sizeof(Header)) != 0)
             {
-            delete[] rows[i];
+            std::memset(file.bytes(), 0, header_bytes);
+            std::memcpy(file.bytes(), &expected, sizeof(Header));
+            file.flush();
             }
-        delete[] rows;
         }
 
-    void display()
+    double* pixels()
+        {
+        return reinterpret_cast<double*>(file.bytes() + header_bytes);
+        }
+
+    bool band_done(int band)
         {
-        for (int i = 0; i < height; i++)
+        return file.bytes()[sizeof(Header) + band] != 0;
+        }
+
+    void mark_band(int band)
+        {
+        file.bytes()[sizeof(Header) + band] = 1;
+        file.flush();
+        }
+    };
+
+// A frame on its way from the compute stage to the colour stage. Slots
+// belong to the compute thread that fills them and go back to its pool once
+// coloured, so each thread has at most two frames in flight.
+struct FrameSlot
+    {
+    int frame;
+    double complex_centre;
+    double real_centre;
+    double complex_range;
+    int max_iter;
+    std::unique_ptr<Image> pixels;                // reused for every frame not checkpointed
+    std::unique_ptr<FrameCheckpoint> checkpoint;  // a checkpointed frame is computed in its .partial
+    std::unique_ptr<Image> mapped;
+    Image* img;
+    BufferPool<FrameSlot>* pool;
+    };
+
+// A frame on its way from the colour stage to the write stage: PPM pixel
+// bytes, or the frame's raw tiles encoded row by row
+struct EncodedFrame
+    {
+    int frame;
+    brotraw::Header header;
+    std::vector<std::vector<uint8_t>> data;
+    };
+
+// Fills img (or the given rows and columns of it) with the counts, or with
+// counts and distances when the job shades by distance
+void populate_job_img(const Job& job, Image* img, double complex_centre, double real_centre,
+                      double complex_range, int max_iter,
+                      int y_first = 0, int y_last = -1, int x_first = 0, int x_last = -1)
+    {
+    if (job.distance > 0)
+        populate_img_distance_auto(img, complex_centre, real_centre, complex_range, max_iter,
+                                   y_first, y_last, x_first, x_last);
+    else
+        populate_img_auto(img, complex_centre, real_centre, complex_range, max_iter,
+                          y_first, y_last, x_first, x_last);
+    }
+
+void compute_frame(const Job& job, int i, Manifest* manifest, FrameSlot* slot)
+    {
+    slot->frame = i;
+    job.frame_viewport(i, &slot->complex_centre, &slot->real_centre, &slot->complex_range);
+    slot->max_iter = job.iterations(slot->complex_range);
+
+    if (!manifest)
+        {
+        slot->img = slot->pixels.get();
+        slot->img->clear();
+        if (job.distance > 0)
+            slot->img->enable_distance(job.distance);
+        populate_job_img(job, slot->img, slot->complex_centre, slot->real_centre, slot->complex_range,
+                         slot->max_iter);
+        }
+    else
+        {
+        slot->checkpoint.reset(new FrameCheckpoint(job.frame_path(i) + ".partial", job.width, job.height,
+                                                   job.checkpoint_band, job.fingerprint()));
+        slot->mapped.reset(new Image(job.width, job.height, slot->checkpoint->pixels()));
+        slot->img = slot->mapped.get();
+
+        for (int band = 0, y = 0; y < job.height; band++, y += job.checkpoint_band)
             {
-            for (int j = 0; j < width; j++)
-                {
-                if(rows[i][j] > 0)
-                    {
-                    std::cout << "*";
-                    }
-                else
+            if (slot->checkpoint->band_done(band))
+                continue;
+            populate_img_auto(slot->img, slot->complex_centre, slot->real_centre, slot->complex_range,
+                              slot->max_iter, y, std::min(y + job.checkpoint_band, job.height));
+            slot->checkpoint->mark_band(band);
+            }
+        }
+
+    // Supersampled colours only exist in PPMs, raw frames keep the 1 spp counts
+    if (job.antialias > 1 && job.format == "ppm")
+        antialias_edges(slot->img, slot->complex_centre, slot->real_centre, slot->complex_range,
+                        slot->max_iter, job.antialias, job.antialias_threshold);
+    }
+
+// Counts of the last frame computed with schedule = tiles, from which the
+// cost of the next frame's tiles is predicted
+struct PreviousFrame
+    {
+    bool valid = false;
+    double complex_centre;
+    double real_centre;
+    double complex_range;
+    int max_iter;
+    std::vector<uint32_t> counts;
+    };
+
+struct TilePlan
+    {
+    int x_first, y_first, x_last, y_last;
+    double cost;      // predicted iterations
+    bool interior;    // every sample stayed bounded in the previous frame
+    };
+
+// Splits frame into tiles and predicts each tile's cost from where its pixels
+// were in the previous frame (zoom frames mostly show the same region). A
+// sample that escaped costs its old count, a bounded one the new max_iter,
+// one outside the previous frame is unknown and costs max_iter. Tiles come
+// back most expensive first, so the slow ones start early instead of being
+// the tail of the frame.
+std::vector<TilePlan> plan_tiles(const Job& job, Image* frame, double complex_centre, double real_centre,
+                                 double complex_range, int max_iter, const PreviousFrame& previous)
+    {
+    const int samples = 4;
+    int tile = job.schedule_tile;
+
+    PixelGrid grid(frame, complex_centre, real_centre, complex_range);
+    double previous_pixel = previous.complex_range / job.height;
+    double previous_real_start = previous.real_centre - previous_pixel * job.width / 2;
+    double previous_complex_start = previous.complex_centre + previous.complex_range / 2;
+
+    std::vector<TilePlan> tiles;
+    for (int y = 0; y < job.height; y += tile)
+        for (int x = 0; x < job.width; x += tile)
+            {
+            TilePlan plan = {x, y, std::min(x + tile, job.width), std::min(y + tile, job.height), 0, previous.valid};
+            for (int sy = 0; sy < samples; sy++)
+                for (int sx = 0; sx < samples; sx++)
                     {
-                    std::cout << " ";
+                    int px = plan.x_first + (plan.x_last - plan.x_first - 1) * sx / (samples - 1);
+                    int py = plan.y_first + (plan.y_last - plan.y_first - 1) * sy / (samples - 1);
+                    long ox = std::lround((grid.real(px) - previous_real_start) / previous_pixel);
+                    long oy = std::lround((previous_complex_start - grid.imag(py)) / previous_pixel);
+
+                    if (!previous.valid || ox < 0 || oy < 0 || ox >= job.width || oy >= job.height)
+                        {
+                        plan.cost += max_iter;
+                        plan.interior = false;
+                        continue;
+                        }
+
+                    uint32_t count = previous.counts[oy * job.width + ox];
+                    bool bounded = (int)count >= previous.max_iter;
+                    plan.cost += bounded ? max_iter : count;
+                    plan.interior = plan.interior && bounded;
                     }
-                }
-            std::cout << std::endl;
+            plan.cost *= (double)(plan.x_last - plan.x_first) * (plan.y_last - plan.y_first) / (samples * samples);
+            tiles.push_back(plan);
             }
+
+    std::stable_sort(tiles.begin(), tiles.end(), [](const TilePlan& a, const TilePlan& b) { return a.cost > b.cost; });
+    return tiles;
+    }
+
+// schedule = tiles: fills slot with every thread working on its tiles, in
+// the order plan_tiles predicts, trying the interior fill first on tiles
+// predicted to be inside the set. Keeps the counts for the next frame.
+void compute_frame_tiled(const Job& job, int i, FrameSlot* slot, PreviousFrame* previous,
+                         const Topology& topology, bool pin)
+    {
+    ZoneScopedNC("compute_frame_tiled", tracy::Color::Orange);
+
+    slot->frame = i;
+    job.frame_viewport(i, &slot->complex_centre, &slot->real_centre, &slot->complex_range);
+    slot->max_iter = job.iterations(slot->complex_range);
+    slot->img = slot->pixels.get();
+
+    Image* img = slot->img;
+    img->clear();
+    if (job.distance > 0)
+        img->enable_distance(job.distance);
+    std::vector<TilePlan> tiles = plan_tiles(job, img, slot->complex_centre, slot->real_centre,
+                                             slot->complex_range, slot->max_iter, *previous);
+
+#pragma omp parallel
+    {
+    if (pin)
+        topology.pin(omp_get_thread_num(), omp_get_num_threads());
+
+#pragma omp for schedule(dynamic, 1)
+    for (size_t t = 0; t < tiles.size(); t++)
+        {
+        const TilePlan& plan = tiles[t];
+        if (plan.interior && fill_interior_auto(img, slot->complex_centre, slot->real_centre, slot->complex_range,
+                                                slot->max_iter, plan.x_first, plan.y_first, plan.x_last, plan.y_last))
+            continue;
+        populate_job_img(job, img, slot->complex_centre, slot->real_centre, slot->complex_range, slot->max_iter,
+                         plan.y_first, plan.y_last, plan.x_first, plan.x_last);
         }
+    }
 
-    void write_to_file(std::string filename)
+    if (job.antialias > 1 && job.format == "ppm")
+        antialias_edges(img, slot->complex_centre, slot->real_centre, slot->complex_range,
+                        slot->max_iter, job.antialias, job.antialias_threshold);
+
+    previous->valid = true;
+    previous->complex_centre = slot->complex_centre;
+    previous->real_centre = slot->real_centre;
+    previous->complex_range = slot->complex_range;
+    previous->max_iter = slot->max_iter;
+    previous->counts.resize((size_t)job.width * job.height);
+    for (int y = 0; y < job.height; y++)
         {
-        // ZoneScoped;
-        ZoneScopedNC("write_to_file", tracy::Color::Green);
-        std::ofstream ofs("../outputs/" + filename + ".ppm", std::ios_base::out | std::ios_base::binary);
-        ofs << "P6\n" << width << ' ' << height << "\n255\n";
+        const double* row = img->get_row_ptr(y);
+        for (int x = 0; x < job.width; x++)
+            previous->counts[(size_t)y * job.width + x] = (uint32_t)row[x];
+        }
+    }
+
+void colour_frame(const Job& job, FrameSlot* slot, EncodedFrame* out)
+    {
+    ZoneScopedNC("colour_frame", tracy::Color::Green);
+
+    Image* img = slot->img;
+    out->frame = slot->frame;
+    out->header = brotraw::make_header(job.width, job.height, job.tile_size, slot->max_iter,
+                                       slot->real_centre, slot->complex_centre, slot->complex_range);
 
+    if (job.format == "raw")
+        {
+        int tiles = out->header.tiles_x * out->header.tiles_y;
+        out->data.resize(tiles);
 
-        double r, g, b;
-        for (auto j = 0u; j < height; ++j)
-            for (auto i = 0u; i < width; ++i)
+        std::vector<uint32_t> tile(job.tile_size * job.tile_size);
+        std::vector<uint8_t> varints;
+        for (int t = 0; t < tiles; t++)
+            {
+            int tx = t % out->header.tiles_x;
+            int ty = t / out->header.tiles_x;
+            int w = std::min(job.tile_size, job.width - tx * job.tile_size);
+            int h = std::min(job.tile_size, job.height - ty * job.tile_size);
+            for (int y = 0; y < h; y++)
                 {
-                colours.get_colour((int)rows[j][i]%255, &r, &g, &b);
+                const double* row = img->get_row_ptr(ty * job.tile_size + y) + tx * job.tile_size;
+                for (int x = 0; x < w; x++)
+                    tile[y * w + x] = (uint32_t)row[x];
+                }
+            brotraw::encode_tile(tile.data(), w, h, varints, out->data[t]);
+            }
+        }
+    else
+        {
+        out->data.resize(1);
+        out->data[0].resize(3 * (size_t)job.width * job.height);
+        img->colour_rows(0, job.height, out->data[0].data());
+        }
+
+    // The counts are no longer needed, a checkpoint's mapping can go
+    slot->checkpoint.reset();
+    slot->mapped.reset();
+    }
+
+void write_encoded_frame(const Job& job, const EncodedFrame& frame, Manifest* manifest)
+    {
+    ZoneScopedNC("write_encoded_frame", tracy::Color::Green);
+
+    std::string path = job.frame_path(frame.frame);
+    if (job.format == "raw")
+        {
+        brotraw::Writer writer(path + ".pbr", frame.header);
+        for (size_t t = 0; t < frame.data.size(); t++)
+            writer.write_encoded(t % frame.header.tiles_x, t / frame.header.tiles_x,
+                                 frame.data[t].data(), frame.data[t].size());
+        writer.close();
+        }
+    else
+        {
+        // Written under a temporary name and renamed into place, so a frame
+        // that exists on disk is always complete
+        std::string tmp = brotraw::temp_path(path + ".ppm");
+        std::ofstream ofs(tmp, std::ios_base::out | std::ios_base::binary);
+        ofs << "P6\n" << job.width << ' ' << job.height << "\n255\n";
+        ofs.write(reinterpret_cast<const char*>(frame.data[0].data()), frame.data[0].size());
+        ofs.close();
+        std::rename(tmp.c_str(), (path + ".ppm").c_str());
+        }
+
+    if (manifest)
+        {
+        manifest->mark_done(frame.frame);
+        unlink((path + ".partial").c_str());
+        }
+    }
+
+// Passes the bands of a streamed frame to write() strictly in order, on a
+// thread of its own so the threads computing bands never wait on the disk.
+// Bands finish in any order and are held until every band before them is
+// written. A band may only start once it is within window bands of the next
+// one to write, which bounds the memory held.
+template <typename Band>
+class OrderedWriter
+    {
+private:
+    std::mutex mutex;
+    std::condition_variable written;
+    std::condition_variable wake;
+    std::map<int, Band> ready;
+    int next;
+    int window;
+    bool stopping;
+    std::function<void(int, const Band&)> write;
+    std::thread writer;
+
+    void run()
+        {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+            {
+            wake.wait(lock, [this]() { return stopping || (!ready.empty() && ready.begin()->first == next); });
+            if (ready.empty() || ready.begin()->first != next)
+                return;
+
+            Band due = std::move(ready.begin()->second);
+            ready.erase(ready.begin());
+
+            lock.unlock();
+            write(next, due);
+            lock.lock();
+
+            next++;
+            written.notify_all();
+            }
+        }
 
-                ofs << static_cast<char>(r)
-                    << static_cast<char>(g)
-                    << static_cast<char>(b);
+public:
+    OrderedWriter(int bands_in_flight, std::function<void(int, const Band&)> write_fn):
+        next(0), window(bands_in_flight), stopping(false), write(write_fn),
+        writer(&OrderedWriter::run, this)
+        {
+        }
+
+    ~OrderedWriter()
+        {
+        finish();
+        }
+
+    // Blocks until band may be started
+    void wait_turn(int band)
+        {
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [&]() { return band < next + window; });
+        }
+
+    void submit(int band, Band&& data)
+        {
+            {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.emplace(band, std::move(data));
+            }
+        wake.notify_one();
+        }
+
+    // Writes everything submitted and stops the writer thread
+    void finish()
+        {
+        if (writer.joinable())
+            {
+                {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
                 }
+            wake.notify_one();
+            writer.join();
             }
+        }
+    };
 
-    double* get_row_ptr(int row_idx)
+// Renders frame i a band of rows at a time, each band coloured (or encoded
+// into raw tiles) by the thread that computed it and appended to the output
+// by an OrderedWriter. Memory is a few bands per thread, whatever the height.
+// With antialias on, bands are computed with a row of overlap above and
+// below so edges are found across band boundaries.
+void render_frame_streamed(const Job& job, int i, const Topology& topology, bool pin)
+    {
+    ZoneScopedNC("render_frame_streamed", tracy::Color::Orange);
+
+    double complex_centre, real_centre, complex_range;
+    job.frame_viewport(i, &complex_centre, &real_centre, &complex_range);
+    int max_iter = job.iterations(complex_range);
+
+    bool raw = job.format == "raw";
+    bool antialias = job.antialias > 1 && !raw;
+    int halo = antialias ? 1 : 0;
+    int band_rows = raw ? (job.stream_band + job.tile_size - 1) / job.tile_size * job.tile_size : job.stream_band;
+    int bands = (job.height + band_rows - 1) / band_rows;
+
+    // A band is its PPM bytes, or its raw tiles encoded left to right, row by row
+    typedef std::vector<std::vector<uint8_t>> Band;
+
+    std::string path = job.frame_path(i) + (raw ? ".pbr" : ".ppm");
+    std::string tmp = brotraw::temp_path(path);
+    std::unique_ptr<brotraw::Writer> raw_writer;
+    std::ofstream ppm;
+    if (raw)
+        raw_writer.reset(new brotraw::Writer(path, brotraw::make_header(job.width, job.height, job.tile_size, max_iter,
+                                                                         real_centre, complex_centre, complex_range)));
+    else
         {
-        return rows[row_idx];
+        ppm.open(tmp, std::ios_base::out | std::ios_base::binary);
+        ppm << "P6\n" << job.width << ' ' << job.height << "\n255\n";
         }
-};
 
-int test_escape(double a, double b)
+    int tiles_x = (job.width + job.tile_size - 1) / job.tile_size;
+    int threads = omp_get_max_threads();
+
+    OrderedWriter<Band> writer(2 * threads, [&](int band, const Band& data)
+        {
+        if (raw)
+            for (size_t t = 0; t < data.size(); t++)
+                raw_writer->write_encoded(t % tiles_x, band * band_rows / job.tile_size + t / tiles_x,
+                                          data[t].data(), data[t].size());
+        else
+            ppm.write(reinterpret_cast<const char*>(data[0].data()), data[0].size());
+        });
+
+    std::atomic<int> next_band(0);
+
+#pragma omp parallel
     {
-    const int max_iter = 500;
-    double z_real = 0;
-    double z_imag = 0;
+    if (pin)
+        topology.pin(omp_get_thread_num(), omp_get_num_threads());
 
-    double z_real_tmp;
+    // One band's worth of pixels per thread, reused for every band it renders
+    std::vector<double> pixels((size_t)(band_rows + 2 * halo) * job.width);
+    std::vector<uint32_t> tile(job.tile_size * job.tile_size);
+    std::vector<uint8_t> varints;
 
-    int iter = 0;
-    while (abs(z_real) < 2 && abs(z_imag) < 2 && iter < max_iter)
+    int band;
+    while ((band = next_band.fetch_add(1)) < bands)
         {
-        z_real_tmp = z_real;
-        z_real = z_real*z_real - z_imag*z_imag + a;
-        z_imag = 2*z_real_tmp*z_imag + b;
-        iter++;
+        writer.wait_turn(band);
+
+        int y_first = band * band_rows;
+        int y_last = std::min(y_first + band_rows, job.height);
+        int top = std::max(y_first - halo, 0);
+        int bottom = std::min(y_last + halo, job.height);
+
+        Image img(job.width, bottom - top, pixels.data());
+        img.place_in_frame(top, job.height);
+        if (job.distance > 0)
+            img.enable_distance(job.distance);
+        populate_job_img(job, &img, complex_centre, real_centre, complex_range, max_iter);
+        if (antialias)
+            antialias_edges(&img, complex_centre, real_centre, complex_range, max_iter,
+                            job.antialias, job.antialias_threshold);
+
+        Band data;
+        if (raw)
+            for (int ty = y_first / job.tile_size; ty * job.tile_size < y_last; ty++)
+                for (int tx = 0; tx < tiles_x; tx++)
+                    {
+                    int w = raw_writer->tile_width(tx);
+                    int h = raw_writer->tile_height(ty);
+                    for (int y = 0; y < h; y++)
+                        {
+                        const double* row = img.get_row_ptr(ty * job.tile_size + y - top) + tx * job.tile_size;
+                        for (int x = 0; x < w; x++)
+                            tile[y * w + x] = (uint32_t)row[x];
+                        }
+                    data.emplace_back();
+                    brotraw::encode_tile(tile.data(), w, h, varints, data.back());
+                    }
+        else
+            {
+            data.emplace_back(3 * (size_t)job.width * (y_last - y_first));
+            img.colour_rows(y_first - top, y_last - top, data[0].data());
+            }
+
+        writer.submit(band, std::move(data));
         }
-    return (double)iter / (double)max_iter;
     }
 
-void populate_img(Image* img, double complex_centre, double real_centre,
-                  double complex_range, double aspect_ratio)
+    writer.finish();
+    if (raw)
+        raw_writer->close();
+    else
+        {
+        ppm.close();
+        std::rename(tmp.c_str(), path.c_str());
+        }
+    }
+
+// Frame progress on stdout. Render threads only bump an atomic counter; the
+// printing (which can block) happens on a thread of its own, which also calls
+// heartbeat once a second so a farm lease stays fresh however long a frame takes.
+class Progress
     {
-    double real_range = complex_range / aspect_ratio;
+private:
+    std::atomic<int> completed;
+    std::atomic<bool> finished;
+    int total;
+    std::function<void()> heartbeat;
+    std::thread reporter;
 
-    double complex_start = complex_centre + complex_range / 2;
-    double complex_end = complex_centre - complex_range / 2;
+    void report()
+        {
+        int shown = -1;
+        auto next = std::chrono::steady_clock::now();
+        auto next_beat = next;
+        while (true)
+            {
+            bool last = finished.load(std::memory_order_acquire);
+            int done = completed.load(std::memory_order_relaxed);
+            auto now = std::chrono::steady_clock::now();
+            if (done != shown && (last || now >= next))
+                {
+                std::cout << done << "/" << total << " frames" << std::endl;
+                shown = done;
+                next = now + std::chrono::seconds(1);
+                }
+            if (now >= next_beat)
+                {
+                heartbeat();
+                next_beat = now + std::chrono::seconds(1);
+                }
+            if (last)
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
 
-    double real_start = real_centre - real_range / 2;
-    double real_end = real_centre + real_range / 2;
+public:
+    Progress(int frames, std::function<void()> heartbeat_fn):
+        completed(0), finished(false), total(frames), heartbeat(heartbeat_fn), reporter(&Progress::report, this)
+        {
+        }
 
-    for (int y = 0; y < img->height; y++)
+    ~Progress()
         {
-        double b = complex_start + ((double)y / img->height) * (complex_end - complex_start);
+        finished.store(true, std::memory_order_release);
+        reporter.join();
+        }
 
-        double* row = img->get_row_ptr(y);
-        for (int x = 0; x < img->width; x++)
+    void frame_done()
+        {
+        completed.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+// Renders frames [first, last] across the OpenMP threads of this process.
+// heartbeat is called about once a second while it runs (see Progress).
+//
+// Threads are pinned to CPUs spread over the NUMA nodes (unless the OpenMP
+// runtime was already told how to bind) and take frames from their own
+// node's share first, stealing from other nodes only when it runs out. Each
+// thread first-touches its own frame buffers after pinning, so the pixels it
+// writes stay in local memory.
+//
+// The OpenMP threads only compute. Finished frames go through a bounded queue
+// to a colour thread (palette lookup or raw tile encoding) and on to a write
+// thread, so no compute thread waits on the disk; when writing falls behind,
+// compute stalls on its two frame buffers instead of piling up frames.
+template <typename F>
+void render_frames(const Job& job, int first, int last, F heartbeat)
+    {
+    std::unique_ptr<Manifest> manifest;
+    if (job.checkpoint)
+        manifest.reset(new Manifest(job));
+
+    Topology topology = Topology::detect();
+    bool pin = job.pin_threads && !openmp_binding_requested();
+    Progress progress(last - first + 1, heartbeat);
+
+    // Streamed frames are rendered one at a time, all threads on its bands
+    if (job.stream)
+        {
+        for (int i = first; i <= last; i++)
             {
-            double a = real_start + ((double)x / img->width) * (real_end - real_start);
-            row[x] = test_escape(a, b) * 255;
+            render_frame_streamed(job, i, topology, pin);
+            progress.frame_done();
             }
+        return;
         }
-    }
 
-void populate_img_vectorised(Image* img, double complex_centre, double real_centre,
-                             double complex_range)
+    NodeQueues queues(first, last, topology.nodes.size());
+
+    int threads = omp_get_max_threads();
+    std::vector<std::unique_ptr<BufferPool<FrameSlot>>> slots(threads);
+    for (std::unique_ptr<BufferPool<FrameSlot>>& pool : slots)
+        pool.reset(new BufferPool<FrameSlot>(2));
+    BufferPool<EncodedFrame> encoded(2);
+
+    // Big enough for every buffer, so only acquiring a buffer ever waits
+    BoundedQueue<FrameSlot*> to_colour(2 * threads + 1);
+    BoundedQueue<EncodedFrame*> to_write(3);
+
+    std::thread colour_stage([&]()
+        {
+        while (FrameSlot* slot = to_colour.pop())
+            {
+            EncodedFrame* frame = encoded.acquire([]() { return new EncodedFrame(); });
+            colour_frame(job, slot, frame);
+            slot->pool->release(slot);
+            to_write.push(frame);
+            }
+        to_write.push(nullptr);
+        });
+
+    std::thread write_stage([&]()
+        {
+        while (EncodedFrame* frame = to_write.pop())
+            {
+            write_encoded_frame(job, *frame, manifest.get());
+            encoded.release(frame);
+            progress.frame_done();
+            }
+        });
+
+    if (job.schedule == "tiles")
+        {
+        // One frame at a time, so a slot is filled by every thread at once
+        BufferPool<FrameSlot> pool(2);
+        PreviousFrame previous;
+        for (int i = first; i <= last; i++)
+            {
+            if (manifest && manifest->done(i))
+                {
+                previous.valid = false;
+                progress.frame_done();
+                continue;
+                }
+
+            FrameSlot* slot = pool.acquire([&]()
+                {
+                FrameSlot* made = new FrameSlot();
+                made->pool = &pool;
+                made->pixels.reset(new Image(job.width, job.height));
+                return made;
+                });
+            compute_frame_tiled(job, i, slot, &previous, topology, pin);
+            to_colour.push(slot);
+            }
+
+        to_colour.push(nullptr);
+        colour_stage.join();
+        write_stage.join();
+        return;
+        }
+
+#pragma omp parallel
     {
-    // ZoneScoped;
-    ZoneScopedNC("populate_img_vectorised", tracy::Color::PowderBlue);
+    int thread = omp_get_thread_num();
+    int node = topology.node_of(thread, omp_get_num_threads());
+    if (pin)
+        topology.pin(thread, omp_get_num_threads());
+
+    BufferPool<FrameSlot>& pool = *slots[thread];
+    auto make_slot = [&]()
+        {
+        FrameSlot* slot = new FrameSlot();
+        slot->pool = &pool;
+        if (!manifest)
+            {
+            slot->pixels.reset(new Image(job.width, job.height));
+            slot->pixels->clear();
+            }
+        return slot;
+        };
 
-    int max_iter = 100 * sqrt(3. / complex_range);
+    int i;
+    while (queues.next(node, &i))
+        {
+        if (manifest && manifest->done(i))
+            {
+            progress.frame_done();
+            continue;
+            }
+
+        FrameSlot* slot = pool.acquire(make_slot);
+        compute_frame(job, i, manifest.get(), slot);
+        to_colour.push(slot);
+        }
+    }
 
-    // int max_iter = 200;
+    to_colour.push(nullptr);
+    colour_stage.join();
+    write_stage.join();
+    }
 
-    double real_range = complex_range / img->aspect_ratio;
 
-    double complex_start = complex_centre + complex_range / 2;
-    double complex_end = complex_centre - complex_range / 2;
+// Frame farm over a spool directory. The coordinator splits the job into
+// ranges of job.chunk frames, one file per range in pending/. Workers claim a
+// range by renaming it into leased/ (rename is atomic, so exactly one worker
+// wins), touch the lease every second while rendering and move it to done/
+// when finished.
+// A lease whose worker died - a local child that exited, or any lease that has
+// not been touched for job.lease_timeout seconds - goes back to pending/.
+// The spool can live on a shared filesystem, with workers started by hand on
+// other nodes: ParallelBrot <job> --worker <spool>
+namespace farm
+    {
+    namespace fs = std::filesystem;
 
-    double real_start = real_centre - real_range / 2;
-    double real_end = real_centre + real_range / 2;
+    std::string range_name(int first, int last)
+        {
+        char name[32];
+        snprintf(name, sizeof(name), "%08d-%08d", first, last);
+        return name;
+        }
 
-    double real_values[img->width];
+    bool parse_range(const std::string& name, int* first, int* last)
+        {
+        return sscanf(name.c_str(), "%d-%d", first, last) == 2;
+        }
 
-    for (int x = 0; x < img->width; x++)
+    std::string host_name()
         {
-        real_values[x] = real_start + ((double)x / img->width) * (real_range);
+        char host[256] = "localhost";
+        gethostname(host, sizeof(host) - 1);
+        return host;
         }
 
-    const __m256d abs_mask = _mm256_set1_pd(0x7FFFFFFFFFFFFFFF);
-    const __m256d threshold = _mm256_set1_pd(2.0);
+    // Lease names are <range>@<host>.<pid> so a coordinator can tell which of
+    // its own children held a lease.
+    std::string lease_owner(pid_t pid)
+        {
+        return "@" + host_name() + "." + std::to_string(pid);
+        }
 
-    for (int y = 0; y < img->height; y++)
+    // True only for a lease held by a process on this host that has exited;
+    // remote owners can only be judged by their heartbeat
+    bool owner_dead(const std::string& lease_name)
         {
-        double* row = img->get_row_ptr(y);
+        size_t at = lease_name.find('@');
+        size_t dot = lease_name.rfind('.');
+        if (at == std::string::npos || dot == std::string::npos || dot < at)
+            return false;
+        if (lease_name.compare(at + 1, dot - at - 1, host_name()) != 0)
+            return false;
+        pid_t pid = std::atoi(lease_name.c_str() + dot + 1);
+        return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+        }
 
-        double c_imag_scalar = complex_start + ((double)y / img->height) * (complex_end - complex_start);
+    size_t count(const fs::path& dir)
+        {
+        std::error_code ec;
+        size_t n = 0;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+            n++;
+        return n;
+        }
 
-        __m256d c_imag = _mm256_set1_pd(c_imag_scalar);
+    void requeue(const fs::path& spool, const fs::path& lease)
+        {
+        std::string name = lease.filename().string();
+        std::error_code ec;
+        fs::rename(lease, spool / "pending" / name.substr(0, name.find('@')), ec);
+        if (!ec)
+            std::cerr << "requeued " << name << std::endl;
+        }
 
-        for (int x = 0; x < img->width; x+=4)
+    void init(const Job& job, const fs::path& spool)
+        {
+        for (const char* dir : {"pending", "leased", "done"})
+            fs::create_directories(spool / dir);
+
+        // Leases left over from a previous coordinator's children; those of
+        // workers still running, here or elsewhere, are left to the timeout
+        std::vector<std::string> leased;
+        std::error_code ec;
+        for (fs::directory_iterator it(spool / "leased", ec), end; !ec && it != end; it.increment(ec))
             {
-            int iters = 0;
-            __m256d z_real = _mm256_set1_pd(0.);
-            __m256d z_imag = _mm256_set1_pd(0.);
+            std::string name = it->path().filename().string();
+            if (owner_dead(name))
+                requeue(spool, it->path());
+            else
+                leased.push_back(name.substr(0, name.find('@')));
+            }
 
-            const __m256d c_real = _mm256_loadu_pd(&real_values[x]);
+        // Keep completed ranges so an interrupted farm picks up where it stopped
+        for (int first = 0; first < job.frames; first += job.chunk)
+            {
+            std::string name = range_name(first, std::min(first + job.chunk, job.frames) - 1);
+            if (!fs::exists(spool / "done" / name) && std::find(leased.begin(), leased.end(), name) == leased.end())
+                std::ofstream(spool / "pending" / name);
+            }
+        }
 
-            while (iters < max_iter)
+    void worker(const Job& job, const fs::path& spool)
+        {
+        std::string owner = lease_owner(getpid());
+
+        while (true)
+            {
+            fs::path lease;
+            int first = 0, last = -1;
+
+            std::error_code ec;
+            for (fs::directory_iterator it(spool / "pending", ec), end; !ec && it != end; it.increment(ec))
                 {
-                const __m256d z_real_tmp = z_real;
-                z_real = _mm256_sub_pd(
-                    _mm256_mul_pd(z_real, z_real),
-                    _mm256_mul_pd(z_imag, z_imag)
-                );
+                std::string name = it->path().filename().string();
+                if (!parse_range(name, &first, &last))
+                    continue;
+
+                fs::path claimed = spool / "leased" / (name + owner);
+                std::error_code rename_ec;
+                fs::rename(it->path(), claimed, rename_ec);
+                if (!rename_ec)
+                    {
+                    // The rename keeps pending/'s old mtime, which may already
+                    // look timed out to the coordinator
+                    fs::last_write_time(claimed, fs::file_time_type::clock::now(), rename_ec);
+                    lease = claimed;
+                    break;
+                    }
+                }
 
-                z_real = _mm256_add_pd(z_real, c_real);
+            if (lease.empty())
+                return;
 
-                z_imag = _mm256_mul_pd(
-                    _mm256_mul_pd(z_real_tmp, z_imag),
-                    _mm256_set1_pd(2.)
-                );
+            render_frames(job, first, last, [&lease]()
+                {
+                std::error_code touch_ec;
+                fs::last_write_time(lease, fs::file_time_type::clock::now(), touch_ec);
+                });
 
-                z_imag = _mm256_add_pd(z_imag, c_imag);
+            // If the lease was taken away from us the range is being redone
+            // elsewhere; the frames we wrote are identical so just move on.
+            fs::rename(lease, spool / "done" / lease.filename().string().substr(0, lease.filename().string().find('@')), ec);
+            }
+        }
 
-                __m256d abs_vec = _mm256_and_pd(z_real, abs_mask);
-                __m256d cmp_result = _mm256_cmp_pd(abs_vec, threshold, _CMP_GT_OQ);
+    // Each local worker is confined to its own slice of the CPUs, so the
+    // workers' OpenMP pools (sized from the affinity mask) neither overlap
+    // nor straddle NUMA nodes more than they must
+    pid_t spawn_worker(const char* self, const std::string& job_path, const fs::path& spool,
+                       const std::vector<int>& cpus)
+        {
+        pid_t pid = fork();
+        if (pid == 0)
+            {
+            restrict_process(cpus);
+            execl(self, self, job_path.c_str(), "--worker", spool.c_str(), (char*)nullptr);
+            std::cerr << "Failed to start worker " << self << std::endl;
+            _exit(1);
+            }
+        return pid;
+        }
 
-                if(_mm256_movemask_pd(cmp_result)) break;
-                iters++;
-                }
+    int coordinator(const Job& job, const std::string& job_path, const fs::path& spool, int num_workers)
+        {
+        init(job, spool);
 
-            double z_real_arr[4] = {0};
-            double z_imag_arr[4] = {0};
+        Topology topology = Topology::detect();
+        std::vector<pid_t> children;
+        std::vector<int> slots;   // CPU slice of each child
 
-            _mm256_storeu_pd(z_real_arr, z_real);
-            _mm256_storeu_pd(z_imag_arr, z_imag);
+        while (true)
+            {
+            // Reap local workers, retrying whatever they still held
+            for (size_t w = 0; w < children.size();)
+                {
+                int status;
+                if (waitpid(children[w], &status, WNOHANG) == children[w])
+                    {
+                    std::string owner = lease_owner(children[w]);
+                    std::error_code ec;
+                    for (fs::directory_iterator it(spool / "leased", ec), end; !ec && it != end; it.increment(ec))
+                        {
+                        std::string name = it->path().filename().string();
+                        if (name.size() > owner.size() && name.compare(name.size() - owner.size(), owner.size(), owner) == 0)
+                            requeue(spool, it->path());
+                        }
+                    children.erase(children.begin() + w);
+                    slots.erase(slots.begin() + w);
+                    }
+                else
+                    w++;
+                }
 
-            for (int x_scalar = 0; x_scalar < 4; x_scalar++)
+            // Retry leases whose (possibly remote) worker stopped heartbeating
+            auto now = fs::file_time_type::clock::now();
+            std::error_code ec;
+            for (fs::directory_iterator it(spool / "leased", ec), end; !ec && it != end; it.increment(ec))
                 {
+                std::error_code time_ec;
+                auto touched = fs::last_write_time(it->path(), time_ec);
+                if (!time_ec && now - touched > std::chrono::seconds(job.lease_timeout))
+                    requeue(spool, it->path());
+                }
 
-                int scalar_iters = iters;
-                double z_real_scalar = z_real_arr[x_scalar];
-                double z_imag_scalar = z_imag_arr[x_scalar];
+            size_t pending = count(spool / "pending");
+            size_t leased = count(spool / "leased");
 
-                while (
-                        abs(z_real_scalar) < 2. &&
-                        abs(z_imag_scalar) < 2.
-                        )
-                    {
-                    double z_real_tmp_scalar = z_real_scalar;
-                    z_real_scalar = z_real_scalar*z_real_scalar - z_imag_scalar*z_imag_scalar + real_values[x+x_scalar];
-                    z_imag_scalar = 2*z_real_tmp_scalar*z_imag_scalar + c_imag_scalar;
+            if (pending == 0 && leased == 0)
+                break;
 
-                    if (scalar_iters > max_iter) break;
-                    scalar_iters++;
-                    }
-                row[x+x_scalar] = (double)scalar_iters;
+            while (pending > 0 && children.size() < (size_t)num_workers)
+                {
+                int slot = 0;
+                while (std::find(slots.begin(), slots.end(), slot) != slots.end())
+                    slot++;
+                children.push_back(spawn_worker("/proc/self/exe", job_path, spool,
+                                                topology.worker_cpus(slot, num_workers)));
+                slots.push_back(slot);
                 }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
             }
+
+        for (pid_t child : children)
+            waitpid(child, nullptr, 0);
+
+        std::cout << "farm complete: " << count(spool / "done") << " ranges" << std::endl;
+        return 0;
+        }
+    }
+
+// Renders every viewport of a thumbnail list through populate_batch. One
+// thumbnail per line, written to job.output + name + ".ppm":
+//   name real_centre complex_centre range [width height]   (default 64 x 64)
+// Iterations follow the job's policy for each range.
+int render_thumbnails(const Job& job, const std::string& list_path)
+    {
+    std::ifstream ifs(list_path);
+    if (!ifs.is_open())
+        {
+        std::cerr << "Error opening thumbnail list: " << list_path << std::endl;
+        exit(1);
+        }
+
+    struct Entry
+        {
+        std::string name;
+        double real_centre, complex_centre, range;
+        int width, height;
+        };
+
+    std::vector<Entry> entries;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(ifs, line))
+        {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::istringstream fields(line);
+        Entry e = {"", 0, 0, 0, 64, 64};
+        if (!(fields >> e.name >> e.real_centre >> e.complex_centre >> e.range) || e.range <= 0)
+            Job::job_error(list_path, line_no, "expected name real_centre complex_centre range [width height]");
+        if (fields >> e.width && (!(fields >> e.height) || e.width <= 0 || e.height <= 0))
+            Job::job_error(list_path, line_no, "bad thumbnail size");
+        entries.push_back(e);
+        }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // In batches, so thousands of thumbnails need not all be in memory at once
+    const size_t batch = 1024;
+    for (size_t first = 0; first < entries.size(); first += batch)
+        {
+        size_t last = std::min(first + batch, entries.size());
+        std::vector<std::unique_ptr<Image>> images;
+        std::vector<Thumbnail> thumbnails;
+        for (size_t t = first; t < last; t++)
+            {
+            const Entry& e = entries[t];
+            images.emplace_back(new Image(e.width, e.height));
+            thumbnails.push_back({images.back().get(), e.complex_centre, e.real_centre, e.range, job.iterations(e.range)});
+            }
+
+        populate_batch(thumbnails);
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t t = first; t < last; t++)
+            images[t - first]->write_to_file(job.output + entries[t].name);
         }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << entries.size() << " thumbnails in " << seconds << " s" << std::endl;
+    return 0;
     }
 
-int main()
+// Times every interleave factor of both kernels on one thread, so the
+// defaults in kernel_config() can be checked on a new machine
+template <typename Lanes>
+void bench_lanes(const char* name)
     {
-//    0.743643887037151 + 0.131825904205330i
-    // double complex_centre = 0.0091976760;
-    // double real_centre = 0.2766433120;
+    Image img(600, 400);
+    int max_iter = 2000;
 
-    // double complex_centre = 1.;
-    // double real_centre = 0.;
+    int best = 1;
+    double best_rate = 0;
+    for (int interleave = 1; interleave <= 4; interleave++)
+        {
+        kernel_config().double_interleave = interleave;
+        kernel_config().float_interleave = interleave;
+
+        auto start = std::chrono::steady_clock::now();
+        populate_img_simd<Lanes>(&img, 0.1318, -0.7436, 0.01, max_iter);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double iterations = 0;
+        for (int y = 0; y < img.height; y++)
+            for (int x = 0; x < img.width; x++)
+                iterations += img.get_row_ptr(y)[x];
+
+        double rate = iterations / seconds;
+        std::cout << name << " x" << Lanes::width << " interleave " << interleave << ": "
+                  << rate / 1e6 << " M iterations/s" << std::endl;
+        if (rate > best_rate)
+            {
+            best_rate = rate;
+            best = interleave;
+            }
+        }
+    std::cout << name << " best interleave: " << best << std::endl;
+    }
 
-    double complex_centre = 0.00000000000000000278793706563379402178294753790944364927085054500163081379043930650189386849765202169477470552201325772332454726999999995;
-    double real_centre =  -1.74995768370609350360221450607069970727110579726252077930242837820286008082972804887218672784431700831100544507655659531379747541999999995;
+void bench_kernels()
+    {
+    KernelConfig defaults = kernel_config();
+    bench_lanes<DoubleLanes>("double");
+    bench_lanes<FloatLanes>("float");
+    kernel_config() = defaults;
+    }
 
-    double complex_range = 3;
+void usage()
+    {
+    std::cerr << "usage: ParallelBrot [job-file]\n"
+              << "       ParallelBrot --bench-kernels\n"
+              << "       ParallelBrot [job-file] --thumbnails <list>\n"
+              << "       ParallelBrot <job-file> --coordinator <spool-dir> [--workers N]\n"
+              << "       ParallelBrot <job-file> --worker <spool-dir>" << std::endl;
+    exit(1);
+    }
 
-#pragma omp parallel for schedule(dynamic,1)
-    for (int i = 0; i < 250; i++)
+int main(int argc, char** argv)
+    {
+    std::string job_path;
+    std::string mode;
+    std::string spool;
+    std::string thumbnail_list;
+    int num_workers = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int a = 1; a < argc; a++)
         {
-        std::cout << i << std::endl;
-        // Image img(1920, 1080);
+        std::string arg = argv[a];
+        if ((arg == "--coordinator" || arg == "--worker") && a + 1 < argc)
+            {
+            mode = arg;
+            spool = argv[++a];
+            }
+        else if (arg == "--thumbnails" && a + 1 < argc)
+            thumbnail_list = argv[++a];
+        else if (arg == "--workers" && a + 1 < argc)
+            num_workers = std::atoi(argv[++a]);
+        else if (arg == "--bench-kernels")
+            {
+            bench_kernels();
+            return 0;
+            }
+        else if (arg[0] != '-' && job_path.empty())
+            job_path = arg;
+        else
+            usage();
+        }
 
-        Image img(600, 400);
+    // Workers are started with the coordinator's job file and must all agree
+    if (!mode.empty() && job_path.empty())
+        usage();
 
-        populate_img_vectorised(&img, complex_centre, real_centre, complex_range * std::pow(0.9, i));
-        img.write_to_file(std::to_string(i));
+    Job job = job_path.empty() ? Job() : Job::load(job_path);
+
+    if (!thumbnail_list.empty())
+        return render_thumbnails(job, thumbnail_list);
+
+    if (mode == "--coordinator")
+        return farm::coordinator(job, job_path, spool, num_workers);
+
+    if (mode == "--worker")
+        {
+        farm::worker(job, spool);
+        return 0;
         }
+
+    render_frames(job, 0, job.frames - 1, []() {});
     return 0;
     }
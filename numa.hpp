@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+
+
+// The NUMA nodes of the machine and the CPUs of each that this process is
+// allowed to run on, read from /sys. Machines (or containers) without that
+// information look like a single node.
+class Topology
+    {
+public:
+    std::vector<std::vector<int>> nodes;
+
+    static std::vector<int> parse_cpulist(const std::string& list)
+        {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ','))
+            {
+            int first, last;
+            int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (fields == 1)
+                last = first;
+            if (fields >= 1)
+                for (int cpu = first; cpu <= last; cpu++)
+                    cpus.push_back(cpu);
+            }
+        return cpus;
+        }
+
+    static Topology detect()
+        {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        Topology topology;
+        for (int node = 0; ; node++)
+            {
+            std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!ifs.is_open())
+                break;
+
+            std::string list;
+            std::getline(ifs, list);
+
+            std::vector<int> cpus;
+            for (int cpu : parse_cpulist(list))
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            if (!cpus.empty())
+                topology.nodes.push_back(cpus);
+            }
+
+        if (topology.nodes.empty())
+            {
+            topology.nodes.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &allowed))
+                    topology.nodes[0].push_back(cpu);
+            }
+        return topology;
+        }
+
+    // Every allowed CPU, node by node
+    std::vector<int> cpus() const
+        {
+        std::vector<int> all;
+        for (const std::vector<int>& node : nodes)
+            all.insert(all.end(), node.begin(), node.end());
+        return all;
+        }
+
+    // Thread t of n goes to node t * nodes / n, so threads are split evenly
+    // across nodes in contiguous blocks, and to the next free CPU there.
+    int node_of(int thread, int threads) const
+        {
+        return (int)((long)thread * nodes.size() / threads);
+        }
+
+    int cpu_of(int thread, int threads) const
+        {
+        int node = node_of(thread, threads);
+        int first = 0;
+        while (node_of(first, threads) != node)
+            first++;
+        return nodes[node][(thread - first) % nodes[node].size()];
+        }
+
+    // Pins the calling thread as thread t of n
+    void pin(int thread, int threads) const
+        {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu_of(thread, threads), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        }
+
+    // CPUs for local worker process w of n: a disjoint slice of cpus(), so
+    // workers fill one node before the next and never share a CPU (unless
+    // there are more workers than CPUs)
+    std::vector<int> worker_cpus(int worker, int workers) const
+        {
+        std::vector<int> all = cpus();
+        std::vector<int> slice;
+        if (workers > (int)all.size())
+            {
+            slice.push_back(all[worker % all.size()]);
+            return slice;
+            }
+        size_t begin = all.size() * worker / workers;
+        size_t end = all.size() * (worker + 1) / workers;
+        slice.assign(all.begin() + begin, all.begin() + end);
+        return slice;
+        }
+    };
+
+// Restricts the calling process (and whatever it execs) to cpus
+inline void restrict_process(const std::vector<int>& cpus)
+    {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    }
+
+// True when the user already chose a binding through the OpenMP runtime
+inline bool openmp_binding_requested()
+    {
+    return getenv("OMP_PROC_BIND") || getenv("OMP_PLACES") || getenv("GOMP_CPU_AFFINITY");
+    }
+
+
+// Work items [first, last] split into one contiguous range per node. A
+// thread takes items from its own node's range and only steals from other
+// nodes once that is empty. Taking an item is a single fetch_add.
+class NodeQueues
+    {
+private:
+    struct alignas(64) Range
+        {
+        std::atomic<int> next;
+        int end;
+        };
+
+    std::unique_ptr<Range[]> ranges;
+    int count;
+
+public:
+    NodeQueues(int first, int last, int nodes):
+        ranges(new Range[nodes]), count(nodes)
+        {
+        long items = (long)last - first + 1;
+        for (int n = 0; n < nodes; n++)
+            {
+            ranges[n].next = first + (int)(items * n / nodes);
+            ranges[n].end = first + (int)(items * (n + 1) / nodes);
+            }
+        }
+
+    bool next(int node, int* item)
+        {
+        for (int k = 0; k < count; k++)
+            {
+            Range& range = ranges[(node + k) % count];
+            if (range.next.load(std::memory_order_relaxed) >= range.end)
+                continue;
+
+            int i = range.next.fetch_add(1, std::memory_order_relaxed);
+            if (i < range.end)
+                {
+                *item = i;
+                return true;
+                }
+            }
+        return false;
+        }
+    };
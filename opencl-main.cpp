@@ -5,79 +5,58 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <filesystem>
 
 #define TRACY_ENABLE
 #include "Tracy.hpp"
 
-class Image
-	{
-  public:
-    int width;
-    int height;
+#include "pipeline.hpp"
 
-    double* r_vals;
-    double* g_vals;
-    double* b_vals;
+// A frame's counts read back from the device, and the same frame as PPM
+// bytes. Both are recycled through BufferPools by the pipeline in main().
+struct FrameCounts
+{
+    int zoomLevel;
+    std::vector<int> counts;
+};
 
-    Image(int w, int h): width(w), height(h) {
-      r_vals = new double[width*height];
-      g_vals = new double[width*height];
-      b_vals = new double[width*height];
+struct FramePixels
+{
+    int zoomLevel;
+    std::vector<unsigned char> rgb;
+};
 
-      for (int i = 0; i < width*height; i++) {
-        r_vals[i] = 0;
-        g_vals[i] = 0;
-        b_vals[i] = 0;
-    	}
-    }
+// Grey level of each count, as the old per-frame Image wrote it
+static void colourFrame(const FrameCounts& frame, FramePixels* out)
+{
+    ZoneScoped;
 
-    ~Image() {
-      delete[] r_vals;
-      delete[] g_vals;
-      delete[] b_vals;
+    out->zoomLevel = frame.zoomLevel;
+    out->rgb.resize(3 * frame.counts.size());
+    const int* counts = frame.counts.data();
+    unsigned char* rgb = out->rgb.data();
+    for (size_t i = 0; i < frame.counts.size(); i++)
+    {
+        unsigned char grey = static_cast<unsigned char>(counts[i]);
+        rgb[3 * i + 0] = grey;
+        rgb[3 * i + 1] = grey;
+        rgb[3 * i + 2] = grey;
     }
+}
 
-    void write_to_file(std::string filename) {
-        ZoneScoped;
-
-	    std::ofstream ofs("../outputs-opencl/" + filename + ".ppm", std::ios_base::out | std::ios_base::binary);
-    	ofs << "P6\n" << width << ' ' << height << "\n255\n";
-
-	    double r, g, b;
-    	for (auto j = 0u; j < height; ++j)
-        	for (auto i = 0u; i < width; ++i) {
-	          r = static_cast<double>(r_vals[i + j*width]);
-    	      g = static_cast<double>(g_vals[i + j*width]);
-        	  b = static_cast<double>(b_vals[i + j*width]);
-
-              ofs << static_cast<char>(r)
-                  << static_cast<char>(g)
-                  << static_cast<char>(b);
-            }
-        }
+static void writeFrame(const FramePixels& frame, int w, int h)
+{
+    ZoneScoped;
 
-    // void write_to_file(const std::string& filename) {
-    //     std::ofstream ofs("../outputs-opencl/" + filename + ".ppm",
-    //                       std::ios_base::binary);
-    //     ofs << "P6\n" << width << ' ' << height << "\n255\n";
-    //
-    //     std::vector<unsigned char> buffer(width * height * 3);
-    //
-    //     // Parallel fill with OpenMP
-    //     for (int j = 0; j < static_cast<int>(height); ++j) {
-    //         for (int i = 0; i < static_cast<int>(width); ++i) {
-    //             const size_t idx = 3 * (j * width + i);
-    //             buffer[idx + 0] = static_cast<unsigned char>(r_vals[i + j * width]);
-    //             buffer[idx + 1] = static_cast<unsigned char>(g_vals[i + j * width]);
-    //             buffer[idx + 2] = static_cast<unsigned char>(b_vals[i + j * width]);
-    //         }
-    //     }
-    //
-    //     ofs.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
-    //     ofs.close();
-    // }
-
- 	};
+    std::ofstream ofs("../outputs-opencl/" + std::to_string(frame.zoomLevel) + ".ppm",
+                      std::ios_base::out | std::ios_base::binary);
+    ofs << "P6\n" << w << ' ' << h << "\n255\n";
+    ofs.write(reinterpret_cast<const char*>(frame.rgb.data()), frame.rgb.size());
+}
 
 
 static std::string loadKernelFile(const char* filename)
@@ -103,14 +82,322 @@ void checkError(cl_int err, const char* operation)
     }
 }
 
-int main()
+static cl_program buildProgram(cl_context context, cl_device_id device, const char* source, const char* options)
+{
+    cl_int err;
+    cl_program program = clCreateProgramWithSource(context, 1, &source, nullptr, &err);
+    checkError(err, "clCreateProgramWithSource");
+
+    // Build (compile) the program
+    err = clBuildProgram(program, 1, &device, options, nullptr, nullptr);
+    if (err != CL_SUCCESS)
+    {
+        // Print build errors if any
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+        std::string buildLog(logSize, '\0');
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &buildLog[0], nullptr);
+        std::cerr << "Error in kernel:\n" << buildLog << std::endl;
+        checkError(err, "clBuildProgram");
+    }
+    return program;
+}
+
+static bool hasDoublePrecision(cl_device_id device)
+{
+    size_t size = 0;
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &size);
+    std::string extensions(size, '\0');
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &extensions[0], nullptr);
+    return extensions.find("cl_khr_fp64") != std::string::npos;
+}
+
+// Same rule as float_precision_enough in brot.hpp: float is used while a
+// pixel is at least 256 float epsilons wide at the magnitude being iterated
+static bool singlePrecisionEnough(double realCentre, double imagCentre, double pixelSpacing)
 {
+    double magnitude = std::max(std::abs(realCentre), std::abs(imagCentre)) + 2;
+    return pixelSpacing >= 256 * magnitude * std::numeric_limits<float>::epsilon();
+}
+
+// A ParallelBrot job's iterations and iteration_scale keys, so thumbnails
+// get the counts the CPU renderer would give them
+struct IterationPolicy
+{
+    int fixedIterations = 0;   // 0 = auto
+    double iterationScale = 100;
+
+    int iterations(double range) const
+    {
+        if (fixedIterations > 0)
+            return fixedIterations;
+        return static_cast<int>(iterationScale * std::sqrt(3. / range));
+    }
+};
+
+// One line of a thumbnail list (the same format ParallelBrot --thumbnails
+// reads): name real_centre imag_centre range [width height]
+struct Thumbnail
+{
+    std::string name;
+    double realCentre;
+    double imagCentre;
+    double range;
+    int width = 64;
+    int height = 64;
+};
+
+static std::vector<Thumbnail> loadThumbnailList(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening thumbnail list: " << path << std::endl;
+        exit(1);
+    }
+
+    std::vector<Thumbnail> thumbnails;
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(file, line))
+    {
+        lineNo++;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::istringstream fields(line);
+        Thumbnail thumbnail;
+        if (!(fields >> thumbnail.name >> thumbnail.realCentre >> thumbnail.imagCentre >> thumbnail.range)
+            || thumbnail.range <= 0)
+        {
+            std::cerr << path << ":" << lineNo << ": expected name real_centre imag_centre range [width height]" << std::endl;
+            exit(1);
+        }
+        if (fields >> thumbnail.width && (!(fields >> thumbnail.height) || thumbnail.width <= 0 || thumbnail.height <= 0))
+        {
+            std::cerr << path << ":" << lineNo << ": bad thumbnail size" << std::endl;
+            exit(1);
+        }
+        thumbnails.push_back(thumbnail);
+    }
+    return thumbnails;
+}
+
+// Runs the thumbnails kernel of program once over every pixel of batch and
+// writes each thumbnail to ../outputs-opencl/thumbnails/<name>.ppm. Real is
+// the precision program was built for.
+template <typename Real>
+static void renderThumbnailBatch(cl_context context, cl_command_queue queue, cl_program program,
+                                 const std::vector<Thumbnail>& batch, const IterationPolicy& policy)
+{
+    ZoneScoped;
+
+    cl_int err;
+    std::vector<int> layout;
+    std::vector<Real> viewports;
+    int pixels = 0;
+    for (const Thumbnail& thumbnail : batch)
+    {
+        // Same grid as PixelGrid in brot.hpp: range is the imaginary extent,
+        // the top row is the largest imaginary part
+        double realRange = thumbnail.range * thumbnail.width / thumbnail.height;
+        layout.push_back(pixels);
+        layout.push_back(thumbnail.width);
+        layout.push_back(policy.iterations(thumbnail.range));
+        viewports.push_back(static_cast<Real>(thumbnail.realCentre - realRange / 2));
+        viewports.push_back(static_cast<Real>(realRange / thumbnail.width));
+        viewports.push_back(static_cast<Real>(thumbnail.imagCentre + thumbnail.range / 2));
+        viewports.push_back(static_cast<Real>(-thumbnail.range / thumbnail.height));
+        pixels += thumbnail.width * thumbnail.height;
+    }
+
+    cl_mem d_layout = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     layout.size() * sizeof(int), layout.data(), &err);
+    checkError(err, "clCreateBuffer(layout)");
+    cl_mem d_viewports = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                        viewports.size() * sizeof(Real), viewports.data(), &err);
+    checkError(err, "clCreateBuffer(viewports)");
+    cl_mem d_counts = clCreateBuffer(context, CL_MEM_WRITE_ONLY, pixels * sizeof(int), nullptr, &err);
+    checkError(err, "clCreateBuffer(counts)");
+
+    cl_kernel kernel = clCreateKernel(program, "thumbnails", &err);
+    checkError(err, "clCreateKernel(thumbnails)");
+
+    int count = static_cast<int>(batch.size());
+    checkError(clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_counts), "clSetKernelArg(C)");
+    checkError(clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_layout), "clSetKernelArg(layout)");
+    checkError(clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_viewports), "clSetKernelArg(viewports)");
+    checkError(clSetKernelArg(kernel, 3, sizeof(int), &count), "clSetKernelArg(count)");
+
+    size_t globalSize = pixels;
+    checkError(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr),
+               "clEnqueueNDRangeKernel(thumbnails)");
+
+    FrameCounts counts;
+    counts.counts.resize(pixels);
+    checkError(clEnqueueReadBuffer(queue, d_counts, CL_TRUE, 0, pixels * sizeof(int), counts.counts.data(), 0, nullptr, nullptr),
+               "clEnqueueReadBuffer(counts)");
+
+    FramePixels rgb;
+    colourFrame(counts, &rgb);
+
+    const std::string thumbnailDir = "../outputs-opencl/thumbnails/";
+    std::error_code dirError;
+    std::filesystem::create_directories(thumbnailDir, dirError);
+    if (dirError)
+    {
+        std::cerr << "Error creating " << thumbnailDir << ": " << dirError.message() << std::endl;
+        exit(1);
+    }
+
+    for (size_t t = 0; t < batch.size(); t++)
+    {
+        const Thumbnail& thumbnail = batch[t];
+        size_t first = 3 * static_cast<size_t>(layout[3 * t]);
+        size_t size = 3 * static_cast<size_t>(thumbnail.width) * thumbnail.height;
+
+        std::string path = thumbnailDir + thumbnail.name + ".ppm";
+        std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+        ofs << "P6\n" << thumbnail.width << ' ' << thumbnail.height << "\n255\n";
+        ofs.write(reinterpret_cast<const char*>(rgb.rgb.data() + first), size);
+        ofs.close();
+        if (!ofs)
+        {
+            std::cerr << "Error writing thumbnail: " << path << std::endl;
+            exit(1);
+        }
+    }
+
+    clReleaseKernel(kernel);
+    clReleaseMemObject(d_counts);
+    clReleaseMemObject(d_viewports);
+    clReleaseMemObject(d_layout);
+}
+
+// Splits thumbnails into launches of at most 1024 images, as ParallelBrot
+// batches them, and at most maxPixels pixels, so neither the counts buffer
+// nor the time one launch keeps the device busy grows with the list
+static std::vector<std::vector<Thumbnail>> splitBatches(const std::vector<Thumbnail>& thumbnails, size_t maxPixels)
+{
+    const size_t maxThumbnails = 1024;
+    std::vector<std::vector<Thumbnail>> batches;
+    size_t pixels = 0;
+    for (const Thumbnail& thumbnail : thumbnails)
+    {
+        size_t size = static_cast<size_t>(thumbnail.width) * thumbnail.height;
+        if (batches.empty() || batches.back().size() == maxThumbnails || pixels + size > maxPixels)
+        {
+            batches.emplace_back();
+            pixels = 0;
+        }
+        batches.back().push_back(thumbnail);
+        pixels += size;
+    }
+    return batches;
+}
+
+// The thumbnails of the list in a few large launches per precision, instead
+// of one launch (and one read-back) per image
+static void renderThumbnails(cl_context context, cl_device_id device, cl_command_queue queue, cl_program program,
+                             cl_program programDouble, const std::string& listPath, const IterationPolicy& policy)
+{
+    std::vector<Thumbnail> singleList, doubleList;
+    for (const Thumbnail& thumbnail : loadThumbnailList(listPath))
+    {
+        bool single = singlePrecisionEnough(thumbnail.realCentre, thumbnail.imagCentre,
+                                            thumbnail.range / thumbnail.height);
+        (single || !programDouble ? singleList : doubleList).push_back(thumbnail);
+    }
+
+    // A full 1920x1080 zoom frame per launch at most, which the zoom itself
+    // already asks of the device, and never more than one buffer may hold
+    cl_ulong maxAlloc = 0;
+    checkError(clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, nullptr),
+               "clGetDeviceInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE)");
+    size_t maxPixels = std::min<size_t>(1920 * 1080, maxAlloc / sizeof(int));
+
+    for (const std::vector<Thumbnail>& batch : splitBatches(singleList, maxPixels))
+        renderThumbnailBatch<float>(context, queue, program, batch, policy);
+    for (const std::vector<Thumbnail>& batch : splitBatches(doubleList, maxPixels))
+        renderThumbnailBatch<double>(context, queue, programDouble, batch, policy);
+}
+
+int main(int argc, char** argv)
+{
+    // GPUBrot renders the zoom; GPUBrot --thumbnails <list> renders a list
+    // of thumbnails instead. --power and --julia pick the fractal, which is
+    // compiled into the kernels (see simplebrot.cl), as is --distance N,
+    // shading by distance to the set with white from N pixels away.
+    // --iterations and --iteration-scale set thumbnail iterations like the
+    // job keys of the same names.
+    std::string thumbnailList;
+    IterationPolicy iterationPolicy;
+    std::ostringstream fractalOptions;
+    fractalOptions.precision(17);
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--thumbnails" && a + 1 < argc)
+            thumbnailList = argv[++a];
+        else if (arg == "--power" && a + 1 < argc)
+        {
+            int power = std::atoi(argv[++a]);
+            if (power < 2 || power > 8)
+            {
+                std::cerr << "--power must be 2..8" << std::endl;
+                return 1;
+            }
+            fractalOptions << " -DPOWER=" << power;
+        }
+        else if (arg == "--julia" && a + 2 < argc)
+        {
+            double juliaReal = std::atof(argv[++a]);
+            double juliaImag = std::atof(argv[++a]);
+            fractalOptions << " -DJULIA -DJULIA_REAL=" << juliaReal << " -DJULIA_IMAG=" << juliaImag;
+        }
+        else if (arg == "--iterations" && a + 1 < argc)
+        {
+            std::string policy = argv[++a];
+            iterationPolicy.fixedIterations = policy == "auto" ? 0 : std::atoi(policy.c_str());
+            if (policy != "auto" && iterationPolicy.fixedIterations <= 0)
+            {
+                std::cerr << "--iterations must be auto or a positive count" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--iteration-scale" && a + 1 < argc)
+        {
+            iterationPolicy.iterationScale = std::atof(argv[++a]);
+            if (!(iterationPolicy.iterationScale > 0))
+            {
+                std::cerr << "--iteration-scale must be positive" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--distance" && a + 1 < argc)
+        {
+            double fade = std::atof(argv[++a]);
+            if (!(fade > 0))
+            {
+                std::cerr << "--distance must be positive" << std::endl;
+                return 1;
+            }
+            fractalOptions << " -DDISTANCE=" << fade;
+        }
+        else
+        {
+            std::cerr << "usage: GPUBrot [--thumbnails <list>] [--iterations auto|N] [--iteration-scale S]\n"
+                      << "               [--power N] [--julia <real> <imag>] [--distance N]" << std::endl;
+            return 1;
+        }
+    }
+
   int h = 1080;
   int w = 1920;
     // ----------------------------------------------------
     // 2) Initialize Data on the Host
     int N = h*w;
-    std::vector<int> h_C(N);
 
 
     // ----------------------------------------------------
@@ -175,37 +462,98 @@ int main()
 
     std::cout << kernelSource << std::endl;
 
-    cl_program program = clCreateProgramWithSource(context, 1, &source, nullptr, &err);
-    checkError(err, "clCreateProgramWithSource");
+    const std::string options = fractalOptions.str();
+    cl_program program = buildProgram(context, device, source, options.c_str());
+    cl_kernel kernel = clCreateKernel(program, "vectorAdd", &err);
+    checkError(err, "clCreateKernel(vectorAdd)");
 
-    // Build (compile) the program
-    err = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
-    if (err != CL_SUCCESS)
+    // Double precision build for the zoom levels float cannot resolve
+    cl_program programDouble = nullptr;
+    cl_kernel kernelDouble = nullptr;
+    if (hasDoublePrecision(device))
     {
-        // Print build errors if any
-        size_t logSize = 0;
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
-        std::string buildLog(logSize, '\0');
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &buildLog[0], nullptr);
-        std::cerr << "Error in kernel:\n" << buildLog << std::endl;
-        checkError(err, "clBuildProgram");
+        programDouble = buildProgram(context, device, source, ("-DUSE_DOUBLE" + options).c_str());
+        kernelDouble = clCreateKernel(programDouble, "vectorAdd", &err);
+        checkError(err, "clCreateKernel(vectorAdd, double)");
+    }
+    else
+    {
+        std::cerr << "Device has no cl_khr_fp64, deep zoom levels will be rendered in float" << std::endl;
     }
-
-    // Create the kernel
-    cl_kernel kernel = clCreateKernel(program, "vectorAdd", &err);
-    checkError(err, "clCreateKernel(vectorAdd)");
     // ----------------------------------------------------
 
+    if (!thumbnailList.empty())
+    {
+        renderThumbnails(context, device, queue, program, programDouble, thumbnailList, iterationPolicy);
+
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+        if (kernelDouble)
+        {
+            clReleaseKernel(kernelDouble);
+            clReleaseProgram(programDouble);
+        }
+        clReleaseMemObject(d_C);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        return 0;
+    }
+
     // ----------------------------------------------------
     // 8) Set kernel arguments
 //    checkError(clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_A), "clSetKernelArg(A)");
 //    checkError(clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_B), "clSetKernelArg(B)");
 
+    // This thread only drives the device. Read-back frames are coloured and
+    // written by two more threads, connected by bounded queues; with three
+    // buffers per stage the device never waits on the disk, and the host
+    // never holds more than six frames.
+    BufferPool<FrameCounts> countBuffers(3);
+    BufferPool<FramePixels> pixelBuffers(3);
+    BoundedQueue<FrameCounts*> toColour(4);
+    BoundedQueue<FramePixels*> toWrite(4);
+
+    std::thread colourStage([&]()
+    {
+        while (FrameCounts* frame = toColour.pop())
+        {
+            FramePixels* pixels = pixelBuffers.acquire([]() { return new FramePixels(); });
+            colourFrame(*frame, pixels);
+            countBuffers.release(frame);
+            toWrite.push(pixels);
+        }
+        toWrite.push(nullptr);
+    });
+
+    std::thread writeStage([&]()
+    {
+        while (FramePixels* pixels = toWrite.pop())
+        {
+            writeFrame(*pixels, w, h);
+            pixelBuffers.release(pixels);
+        }
+    });
+
     for (int zoom_level = 0; zoom_level < 100; zoom_level++) {
+        FrameCounts* frame = countBuffers.acquire([N]()
+        {
+            FrameCounts* counts = new FrameCounts();
+            counts->counts.resize(N);
+            return counts;
+        });
+        frame->zoomLevel = zoom_level;
+
         {
             ZoneScopedN("wait for queue");
-            checkError(clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_C), "clSetKernelArg(C)");
-            checkError(clSetKernelArg(kernel, 1, sizeof(int), &zoom_level), "clSetKernelArg(zoom_level)");
+
+            // Matches the viewport in simplebrot.cl
+            double pixelSpacing = 5 * std::pow(0.9, zoom_level) / w;
+            cl_kernel frameKernel = kernel;
+            if (kernelDouble && !singlePrecisionEnough(-1.7499576837060935, 0., pixelSpacing))
+                frameKernel = kernelDouble;
+
+            checkError(clSetKernelArg(frameKernel, 0, sizeof(cl_mem), &d_C), "clSetKernelArg(C)");
+            checkError(clSetKernelArg(frameKernel, 1, sizeof(int), &zoom_level), "clSetKernelArg(zoom_level)");
             // ----------------------------------------------------
 
             // ----------------------------------------------------
@@ -213,7 +561,7 @@ int main()
             size_t globalSize = N;  // We have N elements
             // We use a 1D NDRange
 
-            checkError(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr),
+            checkError(clEnqueueNDRangeKernel(queue, frameKernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr),
                      "clEnqueueNDRangeKernel");
 
             checkError(clFinish(queue), "clFinish");
@@ -222,29 +570,30 @@ int main()
 
             // ----------------------------------------------------
             // 10) Read results back to the host
-            checkError(clEnqueueReadBuffer(queue, d_C, CL_TRUE, 0, bytes, h_C.data(), 0, nullptr, nullptr),
+            checkError(clEnqueueReadBuffer(queue, d_C, CL_TRUE, 0, bytes, frame->counts.data(), 0, nullptr, nullptr),
                        "clEnqueueReadBuffer(d_C)");
         }
         // ----------------------------------------------------
 
         // ----------------------------------------------------
-        // 11) Print results
-        Image img(w, h);
-
-        for (int i = 0; i < N; i++)
-        {
-            img.r_vals[i] = h_C[i];
-            img.g_vals[i] = h_C[i];
-            img.b_vals[i] = h_C[i];
-        }
-        img.write_to_file(std::to_string(zoom_level));
+        // 11) Hand the frame on to be coloured and written
+        toColour.push(frame);
     }
+
+    toColour.push(nullptr);
+    colourStage.join();
+    writeStage.join();
     // ----------------------------------------------------
 
     // ----------------------------------------------------
     // 12) Cleanup
     clReleaseKernel(kernel);
     clReleaseProgram(program);
+    if (kernelDouble)
+    {
+        clReleaseKernel(kernelDouble);
+        clReleaseProgram(programDouble);
+    }
     clReleaseMemObject(d_C);
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
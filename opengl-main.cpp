@@ -7,57 +7,14 @@
 #include <GLFW/glfw3.h>
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-class Colour
-{
-private:
-    double map_r[256];
-    double map_g[256];
-    double map_b[256];
-
-public:
-    Colour()
-    {
-        double stops[] = {0.0, 0.16, 0.42, 0.6425, 0.8575, 1.0};
-        double reds[] = {0, 32, 237, 255, 0, 0};
-        double greens[] = {7, 107, 255, 170, 2, 0};
-        double blues[] = {100, 203, 255, 0, 0, 0};
-
-        for (int i = 0; i < 256; i++)
-        {
-            double pos = static_cast<double>(i) / 255.0;
-
-            int stop = std::upper_bound(stops, stops + 6, pos) - stops - 1;
-
-            if (stop < 0)
-                stop = 0;
-            if (stop >= 5)
-                stop = 4;
-
-            double start = stops[stop];
-            double end = stops[stop + 1];
-            double range = end - start;
-            double factor = (pos - start) / range;
-
-            // Linear interpolation
-            map_r[i] = (1 - factor) * reds[stop] + factor * reds[stop + 1];
-            map_g[i] = (1 - factor) * greens[stop] + factor * greens[stop + 1];
-            map_b[i] = (1 - factor) * blues[stop] + factor * blues[stop + 1];
-        }
-    }
-
-    void get_colour(int i, double *r, double *g, double *b) const
-    {
-        if (i < 0) i = 0;
-        if (i > 255) i = 255;
-
-        *r = map_r[i];
-        *g = map_g[i];
-        *b = map_b[i];
-    }
-};
-
-
+#include "colour.hpp"
+#include "tilecache.hpp"
 
 static double complex_centre = 0.00000000000000000278793706563379402178294753790944364927085054500163081379043930650189386849765202169477470552201325772332454726999999995;
 static double real_centre =  -1.74995768370609350360221450607069970727110579726252077930242837820286008082972804887218672784431700831100544507655659531379747541999999995;
@@ -87,22 +44,46 @@ uniform vec2 uCentre;
 uniform float uZoom;
 uniform vec2 iResolution;
 
+#ifndef POWER
+#define POWER 2
+#endif
+
+// z^POWER + c by square-and-multiply; POWER is a constant, so this unrolls
+vec2 fractalStep(vec2 z, vec2 c)
+{
+    int top = 1;
+    while (2 * top <= POWER)
+        top *= 2;
+
+    vec2 p = z;
+    for (int bit = top / 2; bit > 0; bit /= 2) {
+        p = vec2(p[0]*p[0] - p[1]*p[1], 2*p[0]*p[1]);
+        if ((POWER & bit) != 0)
+            p = vec2(p[0]*z[0] - p[1]*z[1], p[0]*z[1] + p[1]*z[0]);
+    }
+    return p + c;
+}
+
 void main()
 {
     vec2 uv = gl_FragCoord.xy / iResolution;
 
     vec2 image_range = normalize(iResolution) * 4 * pow(0.9, uZoom);
 
-    vec2 c = (uv * image_range) - (image_range/2) + uCentre;
+    vec2 pixel = (uv * image_range) - (image_range/2) + uCentre;
+#ifdef JULIA
+    vec2 z = pixel;
+    vec2 c = vec2(JULIA_REAL, JULIA_IMAG);
+#else
     vec2 z = vec2(0.0, 0.0);
+    vec2 c = pixel;
+#endif
 
     float max_iters = 100 * sqrt(3. / image_range[1]);
     //float max_iters = 10000;
     int iters = 0;
     while (iters < max_iters && z[0]*z[0] < 4 && z[1]*z[1] < 4) {
-        float tmp_z_real = z[0];
-        z[0] = z[0] * z[0] - z[1]*z[1] + c[0];
-        z[1] = 2*tmp_z_real*z[1] + c[1];
+        z = fractalStep(z, c);
         iters++;
     }
 
@@ -126,21 +107,45 @@ layout(std140) uniform ColoursBlock
     vec4 Colours[256];  // up to 64 floats, for example
 };
 
+#ifndef POWER
+#define POWER 2
+#endif
+
+// z^POWER + c by square-and-multiply; POWER is a constant, so this unrolls
+dvec2 fractalStep(dvec2 z, dvec2 c)
+{
+    int top = 1;
+    while (2 * top <= POWER)
+        top *= 2;
+
+    dvec2 p = z;
+    for (int bit = top / 2; bit > 0; bit /= 2) {
+        p = dvec2(p[0]*p[0] - p[1]*p[1], 2*p[0]*p[1]);
+        if ((POWER & bit) != 0)
+            p = dvec2(p[0]*z[0] - p[1]*z[1], p[0]*z[1] + p[1]*z[0]);
+    }
+    return p + c;
+}
+
 void main()
 {
     dvec2 uv = dvec2(gl_FragCoord.xy) / iResolution;
 
     dvec2 image_range = normalize(iResolution) * 4 * pow(0.9, uZoom);
 
-    dvec2 c = (uv * image_range) - (image_range/2) + uCentre;
+    dvec2 pixel = (uv * image_range) - (image_range/2) + uCentre;
+#ifdef JULIA
+    dvec2 z = pixel;
+    dvec2 c = dvec2(JULIA_REAL, JULIA_IMAG);
+#else
     dvec2 z = vec2(0.0, 0.0);
+    dvec2 c = pixel;
+#endif
 
     int iters = 0;
     double max_iters = 100 * sqrt(3. / image_range[1]);
     while (iters < max_iters && z[0]*z[0] < 4 && z[1]*z[1] < 4) {
-        double tmp_z_real = z[0];
-        z[0] = z[0] * z[0] - z[1]*z[1] + c[0];
-        z[1] = 2*tmp_z_real*z[1] + c[1];
+        z = fractalStep(z, c);
         iters++;
     }
 
@@ -150,6 +155,40 @@ void main()
 }
 )";
 
+// Tiled mode: each cached CPU tile is a texture drawn into its rectangle of
+// the screen. uRect is the rectangle in clip space (x0, y0, x1, y1) and
+// uTexRect the part of the texture mapped onto it (u0, v0, u1, v1), so a
+// parent tile can stand in for a child that is still being computed.
+const char* tileVertexShaderSource = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+
+uniform vec4 uRect;
+uniform vec4 uTexRect;
+
+out vec2 vTex;
+
+void main()
+{
+    vec2 t = aPos.xy * 0.5 + 0.5;
+    gl_Position = vec4(mix(uRect.xy, uRect.zw, t), 0.0, 1.0);
+    vTex = mix(uTexRect.xy, uTexRect.zw, t);
+}
+)";
+
+const char* tileFragmentShaderSource = R"(
+#version 330 core
+in vec2 vTex;
+out vec4 FragColor;
+
+uniform sampler2D uTile;
+
+void main()
+{
+    FragColor = texture(uTile, vTex);
+}
+)";
+
 // A simple fullscreen quad (two triangles) in normalized device coordinates:
 //  (-1,-1) -> bottom-left, (1,1) -> top-right.
 GLfloat quadVertices[] = {
@@ -188,6 +227,215 @@ static void checkCompileErrors(GLuint shader, std::string type)
     }
 }
 
+// A fractal shader with fractal()'s power and Julia constant compiled in as
+// #defines after its #version line. doubleLiterals writes the constant with
+// the lf suffix, for the fp64 shader.
+static std::string fractalShaderSource(const char* source, bool doubleLiterals)
+{
+    const Fractal& f = fractal();
+    std::ostringstream defines;
+    defines.precision(17);
+    defines << "#define POWER " << f.power << "\n";
+    if (f.julia)
+    {
+        const char* suffix = doubleLiterals ? "lf" : "";
+        defines << "#define JULIA\n"
+                << "#define JULIA_REAL " << std::showpoint << f.julia_real << suffix << "\n"
+                << "#define JULIA_IMAG " << f.julia_imag << suffix << "\n";
+    }
+
+    std::string text = source;
+    size_t versionEnd = text.find('\n', text.find("#version")) + 1;
+    return text.insert(versionEnd, defines.str());
+}
+
+static GLuint buildProgram(const char* vertexSource, const char* fragmentSource)
+{
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &vertexSource, NULL);
+    glCompileShader(vertexShader);
+    checkCompileErrors(vertexShader, "VERTEX");
+
+    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+    glCompileShader(fragmentShader);
+    checkCompileErrors(fragmentShader, "FRAGMENT");
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+    checkCompileErrors(program, "PROGRAM");
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return program;
+}
+
+// Composites the view from the CPU tile cache. Tiles are picked at the level
+// whose pixels are no bigger than the screen's; any that are missing are
+// requested from the renderer and, meanwhile, drawn from the closest cached
+// ancestor, upsampled.
+class TileViewer
+{
+private:
+    struct Texture
+    {
+        GLuint id;
+        long last_used;
+    };
+
+    TileCache cache;
+    TileRenderer renderer;
+    Colour colours;
+    std::unordered_map<TileKey, Texture, TileKeyHash> textures;
+    long frame = 0;
+
+    GLuint texture_for(const Tile& tile)
+    {
+        auto found = textures.find(tile.key);
+        if (found != textures.end())
+        {
+            found->second.last_used = frame;
+            return found->second.id;
+        }
+
+        std::vector<unsigned char> rgba(Tile::size * Tile::size * 4);
+        double r, g, b;
+        for (int i = 0; i < Tile::size * Tile::size; i++)
+        {
+            colours.get_colour(tile.counts[i] % 255, &r, &g, &b);
+            rgba[i*4+0] = (unsigned char)r;
+            rgba[i*4+1] = (unsigned char)g;
+            rgba[i*4+2] = (unsigned char)b;
+            rgba[i*4+3] = 255;
+        }
+
+        GLuint id;
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, Tile::size, Tile::size, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+
+        textures[tile.key] = {id, frame};
+        return id;
+    }
+
+    // Textures not drawn for a while are only taking up GPU memory; the
+    // tiles themselves stay in the cache
+    void evict_textures()
+    {
+        for (auto it = textures.begin(); it != textures.end();)
+        {
+            if (frame - it->second.last_used > 120)
+            {
+                glDeleteTextures(1, &it->second.id);
+                it = textures.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+public:
+    TileViewer(size_t cache_bytes, const std::string& spill_dir, int threads)
+        : cache(cache_bytes, spill_dir), renderer(cache, threads)
+    {
+    }
+
+    ~TileViewer()
+    {
+        for (auto& entry : textures)
+            glDeleteTextures(1, &entry.second.id);
+    }
+
+    void draw(GLuint program, GLuint VAO, int displayW, int displayH)
+    {
+        frame++;
+
+        // Same viewport as the shader: the diagonal spans 4 * 0.9^zoom
+        double pixel = 4 * std::pow(0.9, zoom_level) / std::sqrt((double)displayW * displayW + (double)displayH * displayH);
+        double real_range = displayW * pixel;
+        double imag_range = displayH * pixel;
+        double left = real_centre - real_range / 2;
+        double top = complex_centre + imag_range / 2;
+
+        // Past max_tile_level the deepest tiles are magnified instead
+        int level = std::min(max_tile_level, std::max(0, (int)std::ceil(std::log2(4.0 / (Tile::size * pixel)))));
+        double size = std::ldexp(4.0, -level);
+
+        int64_t x0 = (int64_t)std::floor((left + 2) / size);
+        int64_t x1 = (int64_t)std::floor((left + real_range + 2) / size);
+        int64_t y0 = (int64_t)std::floor((2 - top) / size);
+        int64_t y1 = (int64_t)std::floor((2 - top + imag_range) / size);
+
+        std::vector<TileKey> visible;
+        for (int64_t y = y0; y <= y1; y++)
+            for (int64_t x = x0; x <= x1; x++)
+                visible.push_back({level, x, y});
+
+        // The renderer serves newest requests first, so request the tiles
+        // furthest from the centre first and the centre ones last
+        double cx = (real_centre + 2) / size - 0.5;
+        double cy = (2 - complex_centre) / size - 0.5;
+        std::sort(visible.begin(), visible.end(), [cx, cy](const TileKey& a, const TileKey& b)
+        {
+            return std::hypot(a.x - cx, a.y - cy) > std::hypot(b.x - cx, b.y - cy);
+        });
+
+        renderer.cancel_pending();
+
+        glUseProgram(program);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "uTile"), 0);
+        GLint uRect = glGetUniformLocation(program, "uRect");
+        GLint uTexRect = glGetUniformLocation(program, "uTexRect");
+        glBindVertexArray(VAO);
+
+        // Only tiles already in memory are drawn: a spilled one is requested
+        // like a missing one, and a renderer worker reads it back from disk
+        for (const TileKey& key : visible)
+        {
+            std::shared_ptr<const Tile> tile = cache.peek(key);
+            if (!tile)
+            {
+                renderer.request(key);
+
+                TileKey ancestor = key;
+                while (!tile && ancestor.level > 0)
+                {
+                    ancestor = ancestor.parent();
+                    tile = cache.peek(ancestor);
+                }
+                if (!tile)
+                    continue;
+            }
+
+            // The part of the tile's texture covering key; v runs downwards
+            int depth = key.level - tile->key.level;
+            double span = std::ldexp(1.0, -depth);
+            double u0 = (key.x - tile->key.x * ((int64_t)1 << depth)) * span;
+            double v0 = (key.y - tile->key.y * ((int64_t)1 << depth)) * span;
+
+            double x_clip = (key.real_start() - left) / real_range * 2 - 1;
+            double y_clip = (key.complex_start() - top) / imag_range * 2 + 1;
+            double w_clip = size / real_range * 2;
+            double h_clip = size / imag_range * 2;
+
+            glBindTexture(GL_TEXTURE_2D, texture_for(*tile));
+            glUniform4f(uRect, (float)x_clip, (float)(y_clip - h_clip), (float)(x_clip + w_clip), (float)y_clip);
+            glUniform4f(uTexRect, (float)u0, (float)(v0 + span), (float)(u0 + span), (float)v0);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
+
+        glBindVertexArray(0);
+        evict_textures();
+    }
+};
+
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
     // Typically, yoffset is positive for scrolling "up" (zoom in) and
@@ -237,8 +485,45 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     }
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    // GLBrot [--tiles] [--cache-mb N] [--spill DIR] [--power N] [--julia RE IM]
+    // --tiles draws from the CPU tile cache instead of the fragment shader;
+    // --power and --julia pick the fractal for both
+    bool tiled = false;
+    size_t cache_mb = 512;
+    std::string spill_dir;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--tiles")
+            tiled = true;
+        else if (arg == "--cache-mb" && a + 1 < argc)
+            cache_mb = std::atoi(argv[++a]);
+        else if (arg == "--spill" && a + 1 < argc)
+            spill_dir = argv[++a];
+        else if (arg == "--power" && a + 1 < argc)
+        {
+            fractal().power = std::atoi(argv[++a]);
+            if (fractal().power < 2 || fractal().power > 8)
+            {
+                std::cerr << "--power must be 2..8" << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--julia" && a + 2 < argc)
+        {
+            fractal().julia = true;
+            fractal().julia_real = std::atof(argv[++a]);
+            fractal().julia_imag = std::atof(argv[++a]);
+        }
+        else
+        {
+            std::cerr << "usage: GLBrot [--tiles] [--cache-mb N] [--spill DIR] [--power N] [--julia RE IM]" << std::endl;
+            return -1;
+        }
+    }
+
     // 1. Set an error callback (optional, but recommended)
     //glfwSetErrorCallback(glfwErrorCallback);
 
@@ -302,8 +587,10 @@ int main()
     glCompileShader(vertexShader);
     checkCompileErrors(vertexShader, "VERTEX");
 
+    const std::string fragmentSource = fractalShaderSource(fragmentShaderSource, true);
+    const char* fragmentSourceText = fragmentSource.c_str();
     GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
+    glShaderSource(fragmentShader, 1, &fragmentSourceText, NULL);
     glCompileShader(fragmentShader);
     checkCompileErrors(fragmentShader, "FRAGMENT");
 
@@ -366,6 +653,13 @@ int main()
     glBindBuffer(GL_UNIFORM_BUFFER, ubo);
     glBufferData(GL_UNIFORM_BUFFER, 256*4 * sizeof(float),
              colours, GL_STATIC_DRAW);
+
+    GLuint tileProgram = buildProgram(tileVertexShaderSource, tileFragmentShaderSource);
+    std::unique_ptr<TileViewer> viewer;
+    if (tiled)
+        viewer.reset(new TileViewer(cache_mb << 20, spill_dir,
+                                    std::max(2u, std::thread::hardware_concurrency()) - 1));
+
     // 6. Main Render Loop
     // -------------------
     while (!glfwWindowShouldClose(window))
@@ -382,6 +676,13 @@ int main()
         glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
 
+        if (viewer)
+        {
+            viewer->draw(tileProgram, VAO, displayW, displayH);
+            glfwSwapBuffers(window);
+            continue;
+        }
+
         // Use our shader
         glUseProgram(shaderProgram);
 
@@ -419,6 +720,8 @@ int main()
     }
 
     // Cleanup
+    viewer.reset();
+    glDeleteProgram(tileProgram);
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteProgram(shaderProgram);
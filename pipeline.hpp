@@ -0,0 +1,237 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// Pieces for running compute, colouring and file writing as separate stages,
+// so the threads that compute never wait on the disk. Stages hand each other
+// pointers to buffers through BoundedQueues and return the buffers to a
+// BufferPool when done, so no stage can run more than a pool's worth of
+// buffers ahead of the next.
+
+// Waits in a queue or pool: spin briefly, then yield. False once the caller
+// should stop polling and block instead.
+class Backoff
+    {
+private:
+    int attempts = 0;
+
+public:
+    bool pause()
+        {
+        if (attempts >= 128)
+            return false;
+        if (attempts >= 64)
+            std::this_thread::yield();
+        attempts++;
+        return true;
+        }
+    };
+
+// Bounded multi-producer multi-consumer queue (Vyukov's ring buffer). Each
+// cell carries a sequence number saying whether it is free for the producer
+// at that position or full for the consumer, so push and pop are a CAS on
+// one index and never take a lock. The capacity is rounded up to a power of
+// two. push() and pop() wait while the queue is full or empty: they spin for
+// a while, then sleep on a condition variable that every successful push or
+// pop signals, but only takes the lock when somebody is asleep.
+template <typename T>
+class BoundedQueue
+    {
+private:
+    struct alignas(64) Cell
+        {
+        std::atomic<size_t> sequence;
+        T value;
+        };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+
+    alignas(64) std::atomic<int> sleepers;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    bool enqueue(T& value)
+        {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+            {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0)
+                {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                    }
+                }
+            else if (diff < 0)
+                return false;
+            else
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+    bool dequeue(T& value)
+        {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+            {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0)
+                {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                    value = std::move(cell.value);
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                    }
+                }
+            else if (diff < 0)
+                return false;
+            else
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+    // Called after every push or pop. The fences pair with the one in block(),
+    // so either the sleeper's last attempt sees this change or we see it asleep.
+    void wake()
+        {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0)
+            {
+            std::lock_guard<std::mutex> lock(mutex);
+            changed.notify_all();
+            }
+        }
+
+    // Sleeps until attempt() succeeds. It runs under the lock, so it wakes
+    // the other sleepers itself rather than through wake().
+    template <typename F>
+    void block(F attempt)
+        {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        changed.wait(lock, [&]()
+            {
+            if (!attempt())
+                return false;
+            changed.notify_all();
+            return true;
+            });
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+public:
+    explicit BoundedQueue(size_t capacity)
+        {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+        sleepers.store(0, std::memory_order_relaxed);
+        }
+
+    bool try_push(T value)
+        {
+        if (!enqueue(value))
+            return false;
+        wake();
+        return true;
+        }
+
+    bool try_pop(T& value)
+        {
+        if (!dequeue(value))
+            return false;
+        wake();
+        return true;
+        }
+
+    void push(T value)
+        {
+        Backoff backoff;
+        while (!try_push(value))
+            if (!backoff.pause())
+                {
+                block([&]() { return enqueue(value); });
+                return;
+                }
+        }
+
+    T pop()
+        {
+        T value;
+        Backoff backoff;
+        while (!try_pop(value))
+            if (!backoff.pause())
+                {
+                block([&]() { return dequeue(value); });
+                break;
+                }
+        return value;
+        }
+    };
+
+// A fixed number of reusable buffers. Buffers are made on demand by the
+// thread that first acquires them (so their pages are first touched where
+// they will be filled) and acquire() waits once all of them are in use.
+// Only one thread may acquire from a pool; any thread may release to it.
+template <typename T>
+class BufferPool
+    {
+private:
+    BoundedQueue<T*> free_buffers;
+    std::vector<std::unique_ptr<T>> buffers;
+    size_t count;
+
+public:
+    explicit BufferPool(size_t buffer_count):
+        free_buffers(buffer_count), count(buffer_count)
+        {
+        }
+
+    template <typename Make>
+    T* acquire(Make make)
+        {
+        T* buffer;
+        if (free_buffers.try_pop(buffer))
+            return buffer;
+
+        if (buffers.size() < count)
+            {
+            buffers.emplace_back(make());
+            return buffers.back().get();
+            }
+        return free_buffers.pop();
+        }
+
+    void release(T* buffer)
+        {
+        free_buffers.push(buffer);
+        }
+    };
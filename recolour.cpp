@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "colour.hpp"
+#include "brotraw.hpp"
+
+
+// Turns raw frames written with format = raw into PPM images or a single
+// Y4M stream, with a palette chosen at colour time instead of render time.
+//
+//   Recolour [--cycle N] [--offset N] [--palette FILE] [--y4m OUT] frame.pbr...
+//
+// --cycle is the number of iterations per trip through the palette (255
+// matches the colouring ParallelBrot bakes into its PPMs), --offset shifts
+// where the palette starts. A palette file holds one stop per line:
+//   position red green blue        (position 0..1, channels 0..255)
+// Stops may be listed in any order but need distinct positions. Without
+// --y4m every frame.pbr is written next to itself as frame.ppm.
+
+void usage()
+    {
+    std::cerr << "usage: Recolour [--cycle N] [--offset N] [--palette FILE] [--y4m OUT] frame.pbr..." << std::endl;
+    exit(1);
+    }
+
+Colour load_palette(const std::string& path)
+    {
+    std::ifstream ifs(path);
+    if (!ifs.is_open())
+        {
+        std::cerr << "Error opening palette: " << path << std::endl;
+        exit(1);
+        }
+
+    struct Stop
+        {
+        double pos, r, g, b;
+        };
+
+    std::vector<Stop> entries;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(ifs, line))
+        {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        Stop stop;
+        if (fields >> stop.pos >> stop.r >> stop.g >> stop.b)
+            {
+            if (!(stop.pos >= 0 && stop.pos <= 1))
+                {
+                std::cerr << "Palette stop position must be 0..1: " << path << ":" << line_no << std::endl;
+                exit(1);
+                }
+            entries.push_back(stop);
+            }
+        }
+
+    if (entries.size() < 2)
+        {
+        std::cerr << "Palette needs at least two stops: " << path << std::endl;
+        exit(1);
+        }
+
+    // Colour looks segments up by position, so they must be in order, and a
+    // repeated position would make a segment of zero width
+    std::sort(entries.begin(), entries.end(), [](const Stop& a, const Stop& b) { return a.pos < b.pos; });
+
+    std::vector<double> stops, reds, greens, blues;
+    for (size_t i = 0; i < entries.size(); i++)
+        {
+        if (i > 0 && entries[i].pos == entries[i - 1].pos)
+            {
+            std::cerr << "Palette has two stops at position " << entries[i].pos << ": " << path << std::endl;
+            exit(1);
+            }
+        stops.push_back(entries[i].pos);
+        reds.push_back(entries[i].r);
+        greens.push_back(entries[i].g);
+        blues.push_back(entries[i].b);
+        }
+    return Colour(stops, reds, greens, blues);
+    }
+
+// Colour of every count 0..max_iter, so colouring a pixel is one lookup
+class Palette
+    {
+private:
+    std::vector<uint8_t> rgb;
+
+public:
+    Palette(const Colour& colours, uint32_t max_iter, int cycle, int offset):
+        rgb(3 * ((size_t)max_iter + 2))
+        {
+        double r, g, b;
+        for (size_t i = 0; i < rgb.size() / 3; i++)
+            {
+            int index = (int)(((i + offset) % cycle) * 255 / cycle);
+            colours.get_colour(index, &r, &g, &b);
+            rgb[3 * i + 0] = static_cast<uint8_t>(static_cast<char>(r));
+            rgb[3 * i + 1] = static_cast<uint8_t>(static_cast<char>(g));
+            rgb[3 * i + 2] = static_cast<uint8_t>(static_cast<char>(b));
+            }
+        }
+
+    void apply(const uint32_t* counts, size_t n, uint8_t* out) const
+        {
+        size_t last = rgb.size() / 3 - 1;
+
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < n; i++)
+            {
+            const uint8_t* c = &rgb[3 * std::min<size_t>(counts[i], last)];
+            out[3 * i + 0] = c[0];
+            out[3 * i + 1] = c[1];
+            out[3 * i + 2] = c[2];
+            }
+        }
+    };
+
+// RGB to 4:2:0 YCbCr (BT.601, full range as in C420jpeg)
+void write_y4m_frame(std::ofstream& ofs, const uint8_t* rgb, int width, int height)
+    {
+    int cw = (width + 1) / 2;
+    int ch = (height + 1) / 2;
+    std::vector<uint8_t> y_plane((size_t)width * height);
+    std::vector<uint8_t> cb_plane((size_t)cw * ch);
+    std::vector<uint8_t> cr_plane((size_t)cw * ch);
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            {
+            const uint8_t* p = rgb + 3 * ((size_t)y * width + x);
+            y_plane[(size_t)y * width + x] = (uint8_t)(0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2] + 0.5);
+            }
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < ch; y++)
+        for (int x = 0; x < cw; x++)
+            {
+            double r = 0, g = 0, b = 0;
+            int n = 0;
+            for (int dy = 0; dy < 2 && 2 * y + dy < height; dy++)
+                for (int dx = 0; dx < 2 && 2 * x + dx < width; dx++)
+                    {
+                    const uint8_t* p = rgb + 3 * ((size_t)(2 * y + dy) * width + 2 * x + dx);
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                    n++;
+                    }
+            r /= n;
+            g /= n;
+            b /= n;
+            cb_plane[(size_t)y * cw + x] = (uint8_t)std::clamp(128 - 0.168736 * r - 0.331264 * g + 0.5 * b + 0.5, 0., 255.);
+            cr_plane[(size_t)y * cw + x] = (uint8_t)std::clamp(128 + 0.5 * r - 0.418688 * g - 0.081312 * b + 0.5, 0., 255.);
+            }
+
+    ofs << "FRAME\n";
+    ofs.write(reinterpret_cast<const char*>(y_plane.data()), y_plane.size());
+    ofs.write(reinterpret_cast<const char*>(cb_plane.data()), cb_plane.size());
+    ofs.write(reinterpret_cast<const char*>(cr_plane.data()), cr_plane.size());
+    }
+
+int main(int argc, char** argv)
+    {
+    int cycle = 255;
+    int offset = 0;
+    std::string y4m_path;
+    Colour colours;
+    std::vector<std::string> inputs;
+
+    for (int a = 1; a < argc; a++)
+        {
+        std::string arg = argv[a];
+        if (arg == "--cycle" && a + 1 < argc)
+            cycle = std::atoi(argv[++a]);
+        else if (arg == "--offset" && a + 1 < argc)
+            offset = std::atoi(argv[++a]);
+        else if (arg == "--palette" && a + 1 < argc)
+            colours = load_palette(argv[++a]);
+        else if (arg == "--y4m" && a + 1 < argc)
+            y4m_path = argv[++a];
+        else if (arg[0] != '-')
+            inputs.push_back(arg);
+        else
+            usage();
+        }
+
+    if (inputs.empty() || cycle <= 0 || offset < 0)
+        usage();
+
+    std::ofstream y4m;
+    int stream_width = 0, stream_height = 0;
+
+    std::vector<uint32_t> counts;
+    std::vector<uint8_t> rgb;
+
+    for (const std::string& input : inputs)
+        {
+        brotraw::Reader frame(input);
+        int width = frame.header.width;
+        int height = frame.header.height;
+
+        counts.resize((size_t)width * height);
+        rgb.resize(3 * counts.size());
+
+        if (!frame.read_frame(counts.data()))
+            {
+            std::cerr << "Corrupt raw frame: " << input << std::endl;
+            return 1;
+            }
+
+        Palette(colours, frame.header.max_iter, cycle, offset).apply(counts.data(), counts.size(), rgb.data());
+
+        if (y4m_path.empty())
+            {
+            std::string output = input.substr(0, input.rfind(".pbr")) + ".ppm";
+            std::ofstream ofs(output, std::ios_base::out | std::ios_base::binary);
+            ofs << "P6\n" << width << ' ' << height << "\n255\n";
+            ofs.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+            continue;
+            }
+
+        if (!y4m.is_open())
+            {
+            stream_width = width;
+            stream_height = height;
+            y4m.open(y4m_path, std::ios_base::out | std::ios_base::binary);
+            y4m << "YUV4MPEG2 W" << width << " H" << height << " F10:1 Ip A1:1 C420jpeg\n";
+            }
+        else if (width != stream_width || height != stream_height)
+            {
+            std::cerr << "Frame size changes in " << input << ", a Y4M stream needs one size" << std::endl;
+            return 1;
+            }
+
+        write_y4m_frame(y4m, rgb.data(), width, height);
+        }
+
+    return 0;
+    }
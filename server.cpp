@@ -0,0 +1,375 @@
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "tilecache.hpp"
+
+
+// Serves tiles of the quadtree in tilecache.hpp over HTTP on localhost, for
+// interactive explorers.
+//
+//   BrotServer [--port N] [--threads N] [--cache-mb N] [--spill DIR]
+//
+//   GET /tile/<level>/<x>/<y>[?session=S&gen=G][&format=counts]
+//       The 256x256 tile as a PPM, or with format=counts as little-endian
+//       uint32 counts, row 0 at the top. A client bumps gen whenever its
+//       view moves; queued tiles wanted only by older generations of the
+//       session are then dropped, and those requests answered 410 Gone.
+//       Levels go down to max_tile_level, where double precision ends.
+//   GET /stats
+//       Request counters and the tile latency histogram, as JSON.
+//
+// Identical requests in flight are computed once. Queued tiles are served
+// newest first, since the newest request is what is on screen now.
+
+// Latencies in microseconds, 4 buckets per power of two
+class LatencyHistogram
+    {
+private:
+    static const int sub_buckets = 4;
+    static const int buckets = 40 * sub_buckets;
+    std::atomic<uint64_t> counts[buckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max_us;
+
+    static int bucket_of(uint64_t us)
+        {
+        if (us < sub_buckets)
+            return (int)us;
+        int octave = 63 - __builtin_clzll(us);
+        int sub = (int)((us >> (octave - 2)) & (sub_buckets - 1));
+        return std::min((octave - 1) * sub_buckets + sub, buckets - 1);
+        }
+
+    // Largest latency that lands in bucket b
+    static uint64_t upper_bound(int b)
+        {
+        if (b < sub_buckets)
+            return b;
+        int octave = b / sub_buckets + 1;
+        int sub = b % sub_buckets;
+        return ((uint64_t)(sub_buckets + sub + 1) << (octave - 2)) - 1;
+        }
+
+public:
+    LatencyHistogram():
+        total(0), max_us(0)
+        {
+        for (std::atomic<uint64_t>& c : counts)
+            c = 0;
+        }
+
+    void record(uint64_t us)
+        {
+        counts[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = max_us.load(std::memory_order_relaxed);
+        while (us > seen && !max_us.compare_exchange_weak(seen, us, std::memory_order_relaxed))
+            ;
+        }
+
+    uint64_t percentile(double p) const
+        {
+        uint64_t n = total.load(std::memory_order_relaxed);
+        uint64_t rank = (uint64_t)std::ceil(p / 100 * n);
+        uint64_t seen = 0;
+        for (int b = 0; b < buckets; b++)
+            {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0)
+                return std::min(upper_bound(b), max_us.load(std::memory_order_relaxed));
+            }
+        return 0;
+        }
+
+    void write_json(std::ostream& out) const
+        {
+        out << "{\"count\": " << total.load() << ", \"p50\": " << percentile(50) << ", \"p90\": " << percentile(90)
+            << ", \"p99\": " << percentile(99) << ", \"max\": " << max_us.load() << ", \"buckets\": [";
+        bool first = true;
+        for (int b = 0; b < buckets; b++)
+            {
+            uint64_t c = counts[b].load(std::memory_order_relaxed);
+            if (c == 0)
+                continue;
+            out << (first ? "" : ", ") << "[" << upper_bound(b) << ", " << c << "]";
+            first = false;
+            }
+        out << "]}";
+        }
+    };
+
+// Tiles from the cache, or computed by a TileRenderer that coalesces
+// duplicate requests and drops queued work once every client that asked for
+// it has moved on
+class TileService
+    {
+private:
+    TileCache cache;
+
+public:
+    TileRenderer renderer;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> cache_hits{0};
+    LatencyHistogram latency;
+
+    TileService(int threads, size_t cache_bytes, const std::string& spill_dir):
+        cache(cache_bytes, spill_dir), renderer(cache, threads)
+        {
+        }
+
+    // The tile, or null if the request went stale before it was ready
+    std::shared_ptr<const Tile> get(const TileKey& key, const std::string& session, uint64_t gen)
+        {
+        requests++;
+
+        std::shared_ptr<const Tile> tile = cache.get(key);
+        if (tile)
+            {
+            cache_hits++;
+            return tile;
+            }
+        return renderer.wait(key, session, gen);
+        }
+
+    size_t cache_bytes() const
+        {
+        return cache.bytes_used();
+        }
+    };
+
+
+struct Request
+    {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> query;
+    bool keep_alive;
+    };
+
+// Reads one request head from fd, keeping any bytes after it in buffer
+bool read_request(int fd, std::string& buffer, Request* request)
+    {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+        {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0 || buffer.size() > 65536)
+            return false;
+        buffer.append(chunk, n);
+        }
+
+    std::string head = buffer.substr(0, end);
+    buffer.erase(0, end + 4);
+
+    std::istringstream lines(head);
+    std::string target, version;
+    lines >> request->method >> target >> version;
+    request->keep_alive = version == "HTTP/1.1";
+
+    std::string line;
+    while (std::getline(lines, line))
+        {
+        for (char& c : line)
+            c = std::tolower(c);
+        if (line.find("connection:") == 0)
+            request->keep_alive = line.find("close") == std::string::npos;
+        }
+
+    size_t question = target.find('?');
+    request->path = target.substr(0, question);
+    request->query.clear();
+    if (question != std::string::npos)
+        {
+        std::istringstream params(target.substr(question + 1));
+        std::string param;
+        while (std::getline(params, param, '&'))
+            {
+            size_t eq = param.find('=');
+            request->query[param.substr(0, eq)] = eq == std::string::npos ? "" : param.substr(eq + 1);
+            }
+        }
+    return true;
+    }
+
+bool send_all(int fd, const char* data, size_t bytes)
+    {
+    while (bytes > 0)
+        {
+        ssize_t n = send(fd, data, bytes, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n;
+        bytes -= n;
+        }
+    return true;
+    }
+
+bool respond(int fd, int status, const char* reason, const std::string& type, const std::string& body, bool keep_alive)
+    {
+    std::ostringstream head;
+    head << "HTTP/1.1 " << status << ' ' << reason << "\r\n"
+         << "Content-Type: " << type << "\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Access-Control-Allow-Origin: *\r\n"
+         << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+    std::string bytes = head.str() + body;
+    return send_all(fd, bytes.data(), bytes.size());
+    }
+
+// Tile bytes in the palette ParallelBrot uses for its frames
+std::string tile_ppm(const Tile& tile, const Colour& colours)
+    {
+    std::ostringstream ppm;
+    ppm << "P6\n" << Tile::size << ' ' << Tile::size << "\n255\n";
+    std::string body = ppm.str();
+
+    double r, g, b;
+    for (uint32_t count : tile.counts)
+        {
+        colours.get_colour(count % 255, &r, &g, &b);
+        body += static_cast<char>(r);
+        body += static_cast<char>(g);
+        body += static_cast<char>(b);
+        }
+    return body;
+    }
+
+std::string tile_counts(const Tile& tile)
+    {
+    std::string body(tile.counts.size() * sizeof(uint32_t), '\0');
+    std::memcpy(&body[0], tile.counts.data(), body.size());
+    return body;
+    }
+
+void handle_connection(int fd, TileService* service)
+    {
+    Colour colours;
+    std::string buffer;
+    Request request;
+
+    while (read_request(fd, buffer, &request))
+        {
+        auto start = std::chrono::steady_clock::now();
+        bool ok;
+
+        int level;
+        long long x, y;
+        char tail;
+        if (request.method != "GET")
+            ok = respond(fd, 405, "Method Not Allowed", "text/plain", "GET only\n", request.keep_alive);
+        else if (request.path == "/stats")
+            {
+            std::ostringstream json;
+            const TileRenderer& renderer = service->renderer;
+            json << "{\"requests\": " << service->requests << ", \"cache_hits\": " << service->cache_hits
+                 << ", \"coalesced\": " << renderer.coalesced << ", \"computed\": " << renderer.computed
+                 << ", \"cancelled\": " << renderer.cancelled << ", \"stale\": " << renderer.stale
+                 << ", \"pending\": " << service->renderer.pending_tiles() << ", \"cache_bytes\": " << service->cache_bytes()
+                 << ", \"latency_us\": ";
+            service->latency.write_json(json);
+            json << "}\n";
+            ok = respond(fd, 200, "OK", "application/json", json.str(), request.keep_alive);
+            }
+        else if (sscanf(request.path.c_str(), "/tile/%d/%lld/%lld%c", &level, &x, &y, &tail) == 3 &&
+                 level >= 0 && level <= max_tile_level && x >= 0 && y >= 0 && x < (1ll << level) && y < (1ll << level))
+            {
+            uint64_t gen = std::strtoull(request.query["gen"].c_str(), nullptr, 10);
+            std::shared_ptr<const Tile> tile = service->get({level, x, y}, request.query["session"], gen);
+
+            if (!tile)
+                ok = respond(fd, 410, "Gone", "text/plain", "stale generation\n", request.keep_alive);
+            else if (request.query["format"] == "counts")
+                ok = respond(fd, 200, "OK", "application/octet-stream", tile_counts(*tile), request.keep_alive);
+            else
+                ok = respond(fd, 200, "OK", "image/x-portable-pixmap", tile_ppm(*tile, colours), request.keep_alive);
+
+            if (tile)
+                service->latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - start).count());
+            }
+        else
+            ok = respond(fd, 404, "Not Found", "text/plain", "try /tile/<level>/<x>/<y> or /stats\n", request.keep_alive);
+
+        if (!ok || !request.keep_alive)
+            break;
+        }
+    close(fd);
+    }
+
+void usage()
+    {
+    std::cerr << "usage: BrotServer [--port N] [--threads N] [--cache-mb N] [--spill DIR]" << std::endl;
+    exit(1);
+    }
+
+int main(int argc, char** argv)
+    {
+    int port = 8080;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t cache_mb = 512;
+    std::string spill_dir;
+
+    for (int a = 1; a < argc; a++)
+        {
+        std::string arg = argv[a];
+        if (arg == "--port" && a + 1 < argc)
+            port = std::atoi(argv[++a]);
+        else if (arg == "--threads" && a + 1 < argc)
+            threads = std::atoi(argv[++a]);
+        else if (arg == "--cache-mb" && a + 1 < argc)
+            cache_mb = std::atoi(argv[++a]);
+        else if (arg == "--spill" && a + 1 < argc)
+            spill_dir = argv[++a];
+        else
+            usage();
+        }
+
+    if (port <= 0 || threads <= 0)
+        usage();
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    // Local clients only, there is no authentication
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+        {
+        std::cerr << "Error listening on port " << port << ": " << strerror(errno) << std::endl;
+        return 1;
+        }
+
+    TileService service(threads, cache_mb << 20, spill_dir);
+    std::cout << "serving tiles on http://127.0.0.1:" << port << "/ with " << threads << " threads" << std::endl;
+
+    while (true)
+        {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        std::thread(handle_connection, fd, &service).detach();
+        }
+    }
@@ -1,3 +1,122 @@
+// Built twice by the host: as is in single precision, and with -DUSE_DOUBLE
+// (on devices with cl_khr_fp64) for zoom levels where float runs out of bits.
+//
+// The fractal is chosen at build time too: -DPOWER=d (2..8, default 2)
+// iterates z -> z^d + c, and -DJULIA -DJULIA_REAL=a -DJULIA_IMAG=b renders
+// the Julia set of c = a + bi instead (z starts at the pixel).
+//
+// -DDISTANCE=f writes grey levels shaded by the estimated distance to the
+// set instead of counts, as ParallelBrot's distance = f does (see
+// distance_shade).
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#else
+typedef float real;
+#endif
+
+#ifndef POWER
+#define POWER 2
+#endif
+
+// z and c at the start of the iteration for the pixel p
+inline void fractal_start(real p_real, real p_imag, real* z_real, real* z_imag, real* c_real, real* c_imag)
+{
+#ifdef JULIA
+    *z_real = p_real;
+    *z_imag = p_imag;
+    *c_real = JULIA_REAL;
+    *c_imag = JULIA_IMAG;
+#else
+    *z_real = 0;
+    *z_imag = 0;
+    *c_real = p_real;
+    *c_imag = p_imag;
+#endif
+}
+
+// w = z^n. n is a constant wherever this is used, so the square-and-multiply
+// loop unrolls into the shortest chain for it.
+inline void complex_power(real z_real, real z_imag, int n, real* w_real, real* w_imag)
+{
+    real p_real = z_real;
+    real p_imag = z_imag;
+
+    int top = 1;
+    while (2 * top <= n)
+        top *= 2;
+
+    for (int bit = top / 2; bit > 0; bit /= 2) {
+        real tmp = p_real;
+        p_real = p_real*p_real - p_imag*p_imag;
+        p_imag = 2*tmp*p_imag;
+        if (n & bit) {
+            tmp = p_real;
+            p_real = p_real * z_real - p_imag * z_imag;
+            p_imag = tmp * z_imag + p_imag * z_real;
+        }
+    }
+
+    *w_real = p_real;
+    *w_imag = p_imag;
+}
+
+// z = z^POWER + c (z^2 + c for the Mandelbrot set)
+inline void fractal_step(real* z_real, real* z_imag, real c_real, real c_imag)
+{
+    real p_real, p_imag;
+    complex_power(*z_real, *z_imag, POWER, &p_real, &p_imag);
+
+    *z_real = p_real + c_real;
+    *z_imag = p_imag + c_imag;
+}
+
+#ifdef DISTANCE
+// Grey level of the pixel p, pixel wide, from its estimated distance to the
+// set: 0 on and inside it, rising to 254 at DISTANCE pixels away. dz is the
+// derivative of z by c (by the start for Julia sets); an escaped point runs
+// on to |z| = 1e4, for up to 64 iterations past max_iters, where the
+// estimate |z| ln|z| / |dz| is accurate. Unlike ParallelBrot, every pixel is
+// iterated: work-items have no neighbours' disks to fill from.
+inline int distance_shade(real p_real, real p_imag, real pixel, int max_iters)
+{
+    real z_real, z_imag, c_real, c_imag;
+    fractal_start(p_real, p_imag, &z_real, &z_imag, &c_real, &c_imag);
+
+#ifdef JULIA
+    real dz_real = 1;
+#else
+    real dz_real = 0;
+#endif
+    real dz_imag = 0;
+
+    int iters = 0;
+    real r2 = z_real*z_real + z_imag*z_imag;
+    while (r2 <= 1e8f && (r2 <= 4 ? iters < max_iters : iters < max_iters + 64)) {
+        real w_real, w_imag;
+        complex_power(z_real, z_imag, POWER - 1, &w_real, &w_imag);
+        real t_real = w_real*dz_real - w_imag*dz_imag;
+        real t_imag = w_real*dz_imag + w_imag*dz_real;
+        dz_real = POWER * t_real;
+        dz_imag = POWER * t_imag;
+#ifndef JULIA
+        dz_real += 1;
+#endif
+
+        fractal_step(&z_real, &z_imag, c_real, c_imag);
+        r2 = z_real*z_real + z_imag*z_imag;
+        iters++;
+    }
+
+    if (r2 <= 1e8f)
+        return 0;
+
+    real r = sqrt(r2);
+    real estimate = r * log(r) / hypot(dz_real, dz_imag);
+    return (int)(254 * fmin(estimate / (pixel * DISTANCE), (real)1));
+}
+#endif
+
 __kernel void vectorAdd(__global int* C, int zoom_level)
 {
     int i = get_global_id(0);
@@ -8,34 +127,81 @@ __kernel void vectorAdd(__global int* C, int zoom_level)
 //    double real_centre = 0;
 //    double imag_centre = 0;
 
-    float imag_centre =  0.00000000000000000278793706563379402178294753790944364927085054500163081379043930650189386849765202169477470552201325772332454726999999995;
-    float real_centre = -1.74995768370609350360221450607069970727110579726252077930242837820286008082972804887218672784431700831100544507655659531379747541999999995;
+    real imag_centre =  0.00000000000000000278793706563379402178294753790944364927085054500163081379043930650189386849765202169477470552201325772332454726999999995;
+    real real_centre = -1.74995768370609350360221450607069970727110579726252077930242837820286008082972804887218672784431700831100544507655659531379747541999999995;
 
-    float real_range = 5;
+    real real_range = 5;
 
     for (int k = 0; k < zoom_level; k++) {
         real_range *= 0.9;
     }
 
-    float imag_range = (float)real_range / 1920. * 1080.;
+    real imag_range = (real)real_range / 1920. * 1080.;
 
-    float z_real = 0;
-    float z_imag = 0;
+    real p_real = real_centre - real_range / 2 + real_range * ((real)x / 1920.);
+    real p_imag = imag_centre - imag_range / 2 + imag_range * ((real)y / 1080.);
 
-    float c_real = real_centre - real_range / 2 + real_range * ((float)x / 1920.);
-    float c_imag = imag_centre - imag_range / 2 + imag_range * ((float)y / 1080.);
+    int max_iters = 100 * sqrt(3. / imag_range);
 
-    float z_real_tmp;
+#ifdef DISTANCE
+    C[i] = distance_shade(p_real, p_imag, imag_range / 1080, max_iters);
+#else
+    real z_real, z_imag, c_real, c_imag;
+    fractal_start(p_real, p_imag, &z_real, &z_imag, &c_real, &c_imag);
 
     int iters = 0;
-    int max_iters = 100 * sqrt(3. / imag_range);
 
     while (z_real*z_real < 4 & z_imag*z_imag < 4 & iters < max_iters) {
-        z_real_tmp = z_real;
-        z_real = z_real*z_real - z_imag*z_imag + c_real;
-        z_imag = 2*z_real_tmp*z_imag + c_imag;
+        fractal_step(&z_real, &z_imag, c_real, c_imag);
+        iters++;
+    }
+
+    C[i] = iters % 255;
+#endif
+}
+
+// Many small viewports in one launch. The pixels of every viewport are packed
+// back to back, one work-item each; layout holds {first pixel, width,
+// max_iters} and viewports {real_start, real_step, imag_start, imag_step}
+// for each viewport, and the work-item finds its own by binary search.
+__kernel void thumbnails(__global int* C, __global const int* layout,
+                         __global const real* viewports, int count)
+{
+    int i = get_global_id(0);
+
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (layout[3 * mid] <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    int local_index = i - layout[3 * lo];
+    int width = layout[3 * lo + 1];
+    int max_iters = layout[3 * lo + 2];
+    int x = local_index % width;
+    int y = local_index / width;
+
+    real p_real = viewports[4 * lo] + x * viewports[4 * lo + 1];
+    real p_imag = viewports[4 * lo + 2] + y * viewports[4 * lo + 3];
+
+#ifdef DISTANCE
+    C[i] = distance_shade(p_real, p_imag, viewports[4 * lo + 1], max_iters);
+#else
+    real z_real, z_imag, c_real, c_imag;
+    fractal_start(p_real, p_imag, &z_real, &z_imag, &c_real, &c_imag);
+
+    int iters = 0;
+    // |z| <= 2 as in brot.hpp, so counts match ParallelBrot --thumbnails
+    // (up to rounding at the boundary; the CPU kernels use FMA)
+    while (z_real*z_real + z_imag*z_imag <= 4 && iters < max_iters) {
+        fractal_step(&z_real, &z_imag, c_real, c_imag);
         iters++;
     }
 
     C[i] = iters % 255;
-}
\ No newline at end of file
+#endif
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Renders a deep seahorse valley zoom with schedule = frames and with
+# schedule = tiles and fails unless every frame is byte-identical: the tiled
+# scheduler's interior fill must never change a pixel.
+#
+#   tiled_schedule.sh <ParallelBrot>
+set -e
+
+brot="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for schedule in frames tiles; do
+    mkdir "$dir/$schedule"
+    cat > "$dir/$schedule.job" <<JOB
+width = 400
+height = 300
+frames = 30
+zoom_ratio = 0.8
+iteration_scale = 300
+schedule = $schedule
+output = $dir/$schedule/
+keyframe = 0 -0.7436 0.1318 0.05
+JOB
+    "$brot" "$dir/$schedule.job" > /dev/null
+done
+
+status=0
+for frame in "$dir"/frames/*.ppm; do
+    if ! cmp -s "$frame" "$dir/tiles/$(basename "$frame")"; then
+        echo "frame $(basename "$frame" .ppm) differs between schedule = frames and schedule = tiles"
+        status=1
+    fi
+done
+exit $status
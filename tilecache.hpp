@@ -0,0 +1,523 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "brot.hpp"
+
+
+// Iteration tiles on a power-of-two quadtree over the square -2-2i .. 2+2i.
+// Tile (level, x, y) is 4 / 2^level wide; x grows with the real axis and y
+// grows downwards (decreasing imaginary part), like rows of an image. The
+// four children of (l, x, y) are (l + 1, 2x + {0,1}, 2y + {0,1}).
+struct TileKey
+    {
+    int level;
+    int64_t x;
+    int64_t y;
+
+    bool operator==(const TileKey& o) const
+        {
+        return level == o.level && x == o.x && y == o.y;
+        }
+
+    TileKey parent() const
+        {
+        return {level - 1, x >> 1, y >> 1};
+        }
+
+    double size() const
+        {
+        return std::ldexp(4.0, -level);
+        }
+
+    double real_start() const
+        {
+        return -2.0 + x * size();
+        }
+
+    double complex_start() const
+        {
+        return 2.0 - y * size();
+        }
+    };
+
+struct TileKeyHash
+    {
+    size_t operator()(const TileKey& k) const
+        {
+        uint64_t h = (uint64_t)k.level * 0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t)k.x + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+        h ^= (uint64_t)k.y + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+        return h;
+        }
+    };
+
+struct Tile
+    {
+    static const int size = 256;
+
+    TileKey key;
+    uint32_t max_iter;
+    std::vector<uint32_t> counts;   // size x size, row 0 at the top
+
+    size_t bytes() const
+        {
+        return sizeof(Tile) + counts.size() * sizeof(uint32_t);
+        }
+    };
+
+// Deepest level double precision still renders faithfully: a pixel (a
+// 256th of the tile) must stay 256 times wider than the spacing of doubles
+// around |c| + |z| = 4, the margin float_precision_enough asks of floats.
+// Level 36 has pixels of 2^-42, exactly that.
+const int max_tile_level = 36;
+
+// Same policy as a full frame: 100 * sqrt(3 / range), so neighbouring tiles
+// of a level always agree. Clamped in double before converting, so no level
+// can overflow the int.
+inline int tile_iterations(const TileKey& key)
+    {
+    double iterations = 100 * sqrt(3. / key.size());
+    return (int)std::min(iterations, (double)(std::numeric_limits<int>::max() / 2));
+    }
+
+inline std::shared_ptr<Tile> compute_tile(const TileKey& key)
+    {
+    ZoneScopedNC("compute_tile", tracy::Color::Orange);
+
+    auto tile = std::make_shared<Tile>();
+    tile->key = key;
+    tile->max_iter = tile_iterations(key);
+    tile->counts.resize(Tile::size * Tile::size);
+
+    Image img(Tile::size, Tile::size);
+    populate_img_auto(&img, key.complex_start() - key.size() / 2, key.real_start() + key.size() / 2,
+                      key.size(), tile->max_iter);
+
+    for (int y = 0; y < Tile::size; y++)
+        {
+        const double* row = img.get_row_ptr(y);
+        for (int x = 0; x < Tile::size; x++)
+            tile->counts[y * Tile::size + x] = (uint32_t)row[x];
+        }
+    return tile;
+    }
+
+
+// LRU of tiles limited to a byte budget. Tiles pushed out of memory are
+// written to spill_dir (if set), compressed as in brotraw, and read back on
+// the next lookup, so a region visited earlier never needs recomputing.
+class TileCache
+    {
+private:
+    typedef std::list<std::shared_ptr<const Tile>> LruList;
+
+    size_t budget;
+    size_t used;
+    std::string spill_dir;
+    LruList lru;   // most recently used at the front
+    std::unordered_map<TileKey, LruList::iterator, TileKeyHash> entries;
+    std::unordered_set<TileKey, TileKeyHash> spilled;
+    std::unordered_map<TileKey, std::shared_ptr<const Tile>, TileKeyHash> writing;   // evicted, being spilled
+    mutable std::mutex mutex;
+
+    std::string spill_path(const TileKey& k) const
+        {
+        return spill_dir + "/" + std::to_string(k.level) + "_" + std::to_string(k.x) + "_" +
+               std::to_string(k.y) + ".tile";
+        }
+
+    // Writes tiles insert_locked() evicted, without the lock held; each only
+    // counts as spilled once its file is complete
+    void spill(const std::vector<std::shared_ptr<const Tile>>& evicted)
+        {
+        for (const std::shared_ptr<const Tile>& tile : evicted)
+            {
+            std::vector<uint8_t> varints, packed;
+            brotraw::encode_tile(tile->counts.data(), Tile::size, Tile::size, varints, packed);
+
+            std::ofstream ofs(spill_path(tile->key), std::ios_base::out | std::ios_base::binary);
+            ofs.write(reinterpret_cast<const char*>(&tile->max_iter), sizeof(tile->max_iter));
+            ofs.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+            ofs.close();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ofs)
+                spilled.insert(tile->key);
+            writing.erase(tile->key);
+            }
+        }
+
+    std::shared_ptr<Tile> unspill(const TileKey& key) const
+        {
+        std::ifstream ifs(spill_path(key), std::ios_base::in | std::ios_base::binary);
+        std::vector<uint8_t> packed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (packed.size() < sizeof(uint32_t))
+            return nullptr;
+
+        auto tile = std::make_shared<Tile>();
+        tile->key = key;
+        std::memcpy(&tile->max_iter, packed.data(), sizeof(uint32_t));
+        tile->counts.resize(Tile::size * Tile::size);
+
+        std::vector<uint8_t> varints;
+        if (!brotraw::decode_tile(packed.data() + sizeof(uint32_t), packed.size() - sizeof(uint32_t),
+                                  Tile::size, Tile::size, varints, tile->counts.data()))
+            return nullptr;
+        return tile;
+        }
+
+    // Returns the tiles pushed out of memory that the caller must spill()
+    // once it has released the lock
+    std::vector<std::shared_ptr<const Tile>> insert_locked(std::shared_ptr<const Tile> tile)
+        {
+        auto found = entries.find(tile->key);
+        if (found != entries.end())
+            {
+            used -= (*found->second)->bytes();
+            lru.erase(found->second);
+            }
+
+        lru.push_front(tile);
+        entries[tile->key] = lru.begin();
+        used += tile->bytes();
+
+        std::vector<std::shared_ptr<const Tile>> evicted;
+        while (used > budget && lru.size() > 1)
+            {
+            std::shared_ptr<const Tile> victim = lru.back();
+            used -= victim->bytes();
+            entries.erase(victim->key);
+            lru.pop_back();
+            if (!spill_dir.empty() && !spilled.count(victim->key) && writing.emplace(victim->key, victim).second)
+                evicted.push_back(victim);
+            }
+        return evicted;
+        }
+
+public:
+    TileCache(size_t byte_budget, const std::string& spill_directory = ""):
+        budget(byte_budget), used(0), spill_dir(spill_directory)
+        {
+        }
+
+    // The tile if it is in memory or spilled to disk, otherwise null. Disk
+    // reads and writes happen with the lock released.
+    std::shared_ptr<const Tile> get(const TileKey& key)
+        {
+        std::shared_ptr<const Tile> tile;
+        std::vector<std::shared_ptr<const Tile>> evicted;
+            {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto found = entries.find(key);
+            if (found != entries.end())
+                {
+                lru.splice(lru.begin(), lru, found->second);
+                return *found->second;
+                }
+
+            auto in_flight = writing.find(key);
+            if (in_flight != writing.end())
+                {
+                tile = in_flight->second;
+                evicted = insert_locked(tile);
+                }
+            else if (!spilled.count(key))
+                return nullptr;
+            }
+
+        if (!tile)
+            {
+            std::shared_ptr<const Tile> loaded = unspill(key);
+            if (!loaded)
+                return nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Another get() may have brought it back meanwhile
+            auto found = entries.find(key);
+            if (found != entries.end())
+                {
+                lru.splice(lru.begin(), lru, found->second);
+                tile = *found->second;
+                }
+            else
+                {
+                tile = loaded;
+                evicted = insert_locked(tile);
+                }
+            }
+
+        spill(evicted);
+        return tile;
+        }
+
+    // The tile if it is in memory, without ever touching the disk
+    std::shared_ptr<const Tile> peek(const TileKey& key)
+        {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto found = entries.find(key);
+        if (found != entries.end())
+            {
+            lru.splice(lru.begin(), lru, found->second);
+            return *found->second;
+            }
+
+        auto in_flight = writing.find(key);
+        return in_flight != writing.end() ? in_flight->second : nullptr;
+        }
+
+    void put(std::shared_ptr<const Tile> tile)
+        {
+        std::vector<std::shared_ptr<const Tile>> evicted;
+            {
+            std::lock_guard<std::mutex> lock(mutex);
+            evicted = insert_locked(tile);
+            }
+        spill(evicted);
+        }
+
+    size_t bytes_used() const
+        {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+        }
+    };
+
+
+// Fills a TileCache on demand from a pool of worker threads. Requests are
+// served newest first and requests for a tile already queued or running
+// share its computation. A viewer calls request() and cancel_pending() to
+// re-request just what is on screen each frame; a server's clients block in
+// wait(), tagged with a session and a generation they bump whenever their
+// view moves. A newer generation answers the session's older waits at once,
+// and queued tiles nobody is waiting for any more are dropped. Requested tiles
+// the cache spilled are read back by the workers, not recomputed.
+class TileRenderer
+    {
+private:
+    // One blocked wait()
+    struct Waiter
+        {
+        std::string session;
+        uint64_t gen;
+        bool cancelled;
+        };
+
+    // A tile queued or being computed, and who is waiting for it
+    struct Job
+        {
+        TileKey key;
+        bool running = false;
+        bool done = false;
+        std::shared_ptr<const Tile> tile;
+        std::vector<Waiter*> waiters;
+        };
+
+    TileCache& cache;
+    std::function<std::shared_ptr<Tile>(const TileKey&)> compute;
+    std::deque<std::shared_ptr<Job>> pending;   // newest at the back
+    std::unordered_map<TileKey, std::shared_ptr<Job>, TileKeyHash> jobs;   // queued or running
+    std::unordered_map<std::string, uint64_t> sessions;                    // latest gen of each
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool stopping;
+
+    void work()
+        {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+            {
+            wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (stopping)
+                return;
+
+            std::shared_ptr<Job> job = pending.back();
+            pending.pop_back();
+            job->running = true;
+
+            lock.unlock();
+            // A spilled tile is read back rather than computed again
+            std::shared_ptr<const Tile> tile = cache.get(job->key);
+            if (!tile)
+                {
+                std::shared_ptr<Tile> fresh = compute(job->key);
+                cache.put(fresh);
+                computed++;
+                tile = fresh;
+                }
+            lock.lock();
+
+            job->tile = tile;
+            job->done = true;
+            jobs.erase(job->key);
+            finished.notify_all();
+            }
+        }
+
+    // The job for key, queued now unless it already is or is running
+    std::shared_ptr<Job> enqueue_locked(const TileKey& key, bool* existed)
+        {
+        std::shared_ptr<Job>& job = jobs[key];
+        *existed = job != nullptr;
+        if (!job)
+            {
+            job = std::make_shared<Job>();
+            job->key = key;
+            pending.push_back(job);
+            wake.notify_one();
+            }
+        return job;
+        }
+
+    void cancel_stale_locked(const std::string& session, uint64_t gen)
+        {
+        for (auto it = jobs.begin(); it != jobs.end();)
+            {
+            std::vector<Waiter*>& waiters = it->second->waiters;
+            size_t before = waiters.size();
+            for (size_t w = 0; w < waiters.size();)
+                if (waiters[w]->session == session && waiters[w]->gen < gen)
+                    {
+                    waiters[w]->cancelled = true;
+                    waiters.erase(waiters.begin() + w);
+                    }
+                else
+                    w++;
+
+            // Only tiles this cancelled the last waiter of; request()ed
+            // tiles have no waiters and stay queued
+            if (before > 0 && waiters.empty() && !it->second->running)
+                {
+                pending.erase(std::find(pending.begin(), pending.end(), it->second));
+                it = jobs.erase(it);
+                cancelled++;
+                }
+            else
+                it++;
+            }
+        finished.notify_all();
+        }
+
+public:
+    std::atomic<uint64_t> computed{0};
+    std::atomic<uint64_t> coalesced{0};   // waits that joined a tile already queued or running
+    std::atomic<uint64_t> cancelled{0};   // queued tiles dropped by a newer generation
+    std::atomic<uint64_t> stale{0};       // waits answered without a tile
+
+    TileRenderer(TileCache& tile_cache, int threads,
+                 std::function<std::shared_ptr<Tile>(const TileKey&)> compute_fn = compute_tile):
+        cache(tile_cache), compute(compute_fn), stopping(false)
+        {
+        for (int t = 0; t < threads; t++)
+            workers.emplace_back(&TileRenderer::work, this);
+        }
+
+    ~TileRenderer()
+        {
+            {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            }
+        wake.notify_all();
+        finished.notify_all();
+        for (std::thread& t : workers)
+            t.join();
+        }
+
+    void request(const TileKey& key)
+        {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool existed;
+        enqueue_locked(key, &existed);
+        }
+
+    // Forgets every queued tile nobody is waiting for
+    void cancel_pending()
+        {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = pending.begin(); it != pending.end();)
+            if ((*it)->waiters.empty())
+                {
+                jobs.erase((*it)->key);
+                it = pending.erase(it);
+                }
+            else
+                it++;
+        }
+
+    // Blocks until the tile is in the cache, computing it if need be. Null
+    // if the request went stale first: an empty session never does.
+    std::shared_ptr<const Tile> wait(const TileKey& key, const std::string& session = "", uint64_t gen = 0)
+        {
+        Waiter waiter = {session, gen, false};
+
+        std::shared_ptr<const Tile> tile = cache.get(key);
+        if (tile)
+            return tile;
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // It may have been finished since; spilled tiles are left to a
+        // worker, so no disk I/O ever happens under the lock
+        tile = cache.peek(key);
+        if (tile)
+            return tile;
+
+        if (!session.empty())
+            {
+            uint64_t& latest = sessions[session];
+            if (gen < latest)
+                {
+                stale++;
+                return nullptr;
+                }
+            if (gen > latest)
+                {
+                latest = gen;
+                cancel_stale_locked(session, gen);
+                }
+            }
+
+        bool existed;
+        std::shared_ptr<Job> job = enqueue_locked(key, &existed);
+        if (existed)
+            coalesced++;
+        job->waiters.push_back(&waiter);
+
+        finished.wait(lock, [&]() { return job->done || waiter.cancelled || stopping; });
+        if (!job->done)
+            {
+            if (!waiter.cancelled)
+                job->waiters.erase(std::find(job->waiters.begin(), job->waiters.end(), &waiter));
+            stale++;
+            return nullptr;
+            }
+        return job->tile;
+        }
+
+    size_t pending_tiles()
+        {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending.size();
+        }
+    };